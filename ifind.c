@@ -7,21 +7,26 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <time.h>
 #include <locale.h>
 #include <xlocale.h>
 #include <regex.h>
+#include <fnmatch.h>
 #include <math.h>
 #include <limits.h>
 
 /* Postgres includes. Requires Postgres development packages. */
 #include "libpq-fe.h"
+#include "pg_config.h"
 
 /* Exit codes. */
 #define SUCCESS ((int) 0)
@@ -64,12 +69,32 @@ static int verbose = false;
 /* Progress indicator. */
 static int progress = 0;
 
+/* Percent of the data pages sampled by the preflight, -1 for none. */
+static double preflight_percent = -1.0;
+
+/* Rows the preflight expects the scan to see, 0 when not known. */
+static long long unsigned estimate_rows = 0;
+
 /* SQL statement. */
 static char *sqlstmt = NULL;
 
 /* Number of SQL statements executed. */
 static long unsigned nsqlstmt = 0;
 
+/* Rows the SQL statements returned or changed. */
+static long long unsigned nsqlrows = 0;
+
+/* Ids in one SQL statement as an array, 0 for one statement an id. */
+static int sqlbatch = 0;
+
+/* Number of SQL statements failed on the write connection. */
+static long unsigned nsqlfailed = 0;
+
+/* SQL statements in a commit on the write connection, 0 to run them in
+   the scan transaction, and the seconds a commit waits at most. */
+static int write_group = 0;
+static double write_seconds = 0.0;
+
 /* Regexp. */
 static char *regexp = NULL;
 
@@ -82,6 +107,35 @@ static char *regexpsubst = NULL;
 /* Replica number. Signal no preferred replica as default. */
 static char *replica = NULL;
 
+/* Replica policy, the preferences for the one replica of an object
+   listed, NULL for all replicas. */
+static char *replica_policy = NULL;
+
+/* One replica of an object, the first seen, without preferences. */
+static boolean replica_any = false;
+
+/* State file of the incremental scan, NULL for a full scan. */
+static char *state_file = NULL;
+
+/* Objects and collections created or modified at or after this time
+   are selected, -1 for all of them. */
+static long long watermark = -1;
+
+/* The watermark of the next incremental scan. */
+static long long next_watermark = 0;
+
+/* Seconds between the polls of the watch mode, 0 for one scan. */
+static int watch_seconds = 0;
+
+/* Objects with a larger id are new since the last poll, -1 before the
+   first poll. */
+static long long watch_id = -1;
+
+/* Columns with the time of the last change of an object or collection,
+   selected last when watching. */
+#define CHANGED_DATA ",greatest(d.modify_ts,d.create_ts)::bigint"
+#define CHANGED_COLL ",greatest(c.modify_ts,c.create_ts)::bigint"
+
 /* Resource. */
 static char *resource = NULL;
 
@@ -112,6 +166,140 @@ static int delay_retry = 59;
 /* Counter for retries. Will count down from maximum value. */
 static int retry_failures = 0;
 
+/* Directories only. */
+static boolean dirsonly = false;
+
+/* Print file id with the name. */
+static boolean printid = false;
+
+/* Command to execute for all files. */
+static char *command = NULL;
+
+/* UTF-8 checker locale. */
+static char *utf = NULL;
+
+/* Number of tasks, 0 means paralellism disabled. */
+static int ntasks = 0;
+
+/* Scan files with a single join over the whole tree. */
+static boolean joinscan = false;
+
+/* Prefetch the next batch asynchronously. */
+static boolean prefetch = false;
+
+/* Stream the listing with COPY instead of cursors. */
+static boolean copyscan = false;
+
+/* Binary result format for the scans. */
+static boolean binary = false;
+
+/* Keyset paginated scan in short transactions. */
+static boolean keyset = false;
+
+/* Metadata condition. */
+typedef struct avu {
+
+	/* Attribute name. */
+	char *attr;
+
+	/* Comparison, =, !=, <, <=, > or >=. */
+	char *op;
+
+	/* Value, a prefix when it ends with *, NULL for any. */
+	char *value;
+
+	/* Unit, NULL for any. */
+	char *unit;
+
+	/* Next condition. */
+	struct avu *next;
+} avu_t;
+
+/* Metadata conditions the objects must all meet. */
+static avu_t *avus = NULL;
+
+/* Pruned collection pattern. */
+typedef struct prune {
+
+	/* Glob on the collection name, * and ? match slashes too. */
+	char *pattern;
+
+	/* Next pattern. */
+	struct prune *next;
+} prune_t;
+
+/* Collections left out with everything below them. */
+static prune_t *prunes = NULL;
+
+/* Room the prune conditions take in a query. */
+static size_t prunes_size = 0;
+
+/* Root collection of a tree to scan. */
+typedef struct root {
+
+	/* Collection name. */
+	char *name;
+
+	/* The name and a slash, which sort like the trees. */
+	char *key;
+	size_t key_len;
+
+	/* Files and bytes seen in the tree. */
+	long long unsigned fno;
+	long long unsigned total;
+} root_t;
+
+/* Root collections, sorted by key and not overlapping. */
+static root_t *roots = NULL;
+static int nroots = 0;
+
+/* Room the root conditions take in a query. */
+static size_t roots_size = 0;
+
+/* Expression selecting the files. */
+static char *expression = NULL;
+
+/* The database matches the -X regexp. */
+static boolean pushdown_regexp = false;
+
+/* The database checks the -l length. */
+static boolean pushdown_length = false;
+
+/* Only the summary is asked, the database counts. */
+static boolean aggregate = false;
+
+/* Usage report collection depth below the root, -1 for no report. */
+static int report_depth = -1;
+
+/* Usage report as CSV instead of a table. */
+static boolean report_csv = false;
+
+/* Number of parallel scan connections, 0 for a single scan. */
+static int nparts = 0;
+
+/* Partition of the collections scanned by this process, -1 for all. */
+static int part = -1;
+
+/* Collections with at least this many files are split, 0 for none. */
+static long long unsigned split_size = 0;
+
+/* Number of id ranges a split collection is scanned in. */
+static int split_ranges = 4;
+
+/* Connect string. */
+static char *connect_string = "dbname=ICAT user=irods";
+
+/* Seconds spent waiting for the database. */
+static double dbwait = 0.0;
+
+/* Adapt the fetch size, to a target time per fetch, or to the memory
+   only when the time is 0. */
+static boolean adaptive = false;
+static double adapt_time = 0.0;
+
+/* Target result memory per fetch when adapting the fetch size. */
+static double adapt_memory = 4.0 * 1024.0 * 1024.0;
+
 /* Error exit. */
 
 static void
@@ -174,6 +362,20 @@ pmsg (char *format, ...)
 	va_end (args);
 }
 
+/* Monotonic clock in seconds, for measuring waits. */
+
+static double
+clock_seconds (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+	{
+		err (FAILURE, "Function clock_gettime failed - confused");
+	}
+	return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
 /* Allocate with check. */
 
 static void *
@@ -344,6 +546,12 @@ transformpath (char *t, char *pathname)
 				/* Write transformed pathname. */
 				(void) strncpy (t, r, PATHNAME_LENGTH);
 			}
+			else
+			{
+
+				/* Nothing to substitute, the pathname as it is. */
+				(void) strncpy (t, pathname, PATHNAME_LENGTH);
+			}
 		}
 		else
 		{
@@ -442,18 +650,127 @@ perr (int rc, PGconn *conn, char *format, ...)
 	exit (rc);
 }
 
+/* Execute Postgres command, results in text (0) or binary (1) format. */
+
+static PGresult *
+pcmd_format (PGconn *conn, char *cmd, int format)
+{
+
+	/* Command result. */
+	PGresult *res;
+	ExecStatusType pstat;
+
+	/* Time waited. */
+	double t;
+
+	/* Excecute Postgres command. */
+	t = clock_seconds ();
+	if (format == 0)
+	{
+		res = PQexec(conn, cmd);
+	}
+	else
+	{
+		res = PQexecParams(conn, cmd, 0, NULL, NULL, NULL, NULL, format);
+	}
+	dbwait += clock_seconds () - t;
+
+	/* Ignore success. */
+	pstat = PQresultStatus(res);
+	if (pstat != PGRES_COMMAND_OK && pstat != PGRES_TUPLES_OK)
+	{
+
+		/* Cleanup and exit. */
+		perr (PGRESEXEC, conn, "Error %s executing '%s'",
+			PQresStatus(pstat), cmd);
+	}
+	return (res);
+}
+
 /* Execute Postgres command. */
 
 PGresult *
 pcmd (PGconn *conn, char *cmd)
+{
+	return (pcmd_format (conn, cmd, 0));
+}
+
+/* Send Postgres command without waiting for the result. */
+
+static void
+psend (PGconn *conn, char *cmd, int format)
+{
+	int status;
+
+	if (format == 0)
+	{
+		status = PQsendQuery (conn, cmd);
+	}
+	else
+	{
+		status = PQsendQueryParams (conn, cmd, 0, NULL, NULL, NULL, NULL,
+			format);
+	}
+	if (! status)
+	{
+		perr (PGRESEXEC, conn, "Error sending '%s'", cmd);
+	}
+}
+
+/* Integer value of a field, binary is big endian 2, 4 or 8 bytes. */
+
+static long long unsigned
+value_id (char *v, int len, int format)
+{
+	long long unsigned r;
+	int i;
+
+	if (format == 0)
+	{
+		return ((long long unsigned) atoll (v));
+	}
+	if (len != 2 && len != 4 && len != 8)
+	{
+		err (FAILURE, "Binary integer of %d bytes - confused", len);
+	}
+	r = (long long unsigned) 0;
+	for (i=0; i<len; i++)
+	{
+		r = (r << 8) | (long long unsigned) (unsigned char) v[i];
+	}
+	return (r);
+}
+
+/* Collect result of a command sent with psend. */
+
+static PGresult *
+pcollect (PGconn *conn, char *cmd)
 {
 
 	/* Command result. */
 	PGresult *res;
+	PGresult *extra;
 	ExecStatusType pstat;
 
-	/* Excecute Postgres command. */
-	res = PQexec(conn, cmd);
+	/* Time waited. */
+	double t;
+
+	/* Wait for the result. */
+	t = clock_seconds ();
+	res = PQgetResult (conn);
+	if (res == NULL)
+	{
+		perr (PGRESEXEC, conn, "No result for '%s' - confused", cmd);
+	}
+
+	/* There is one statement, read until the end of results. */
+	extra = PQgetResult (conn);
+	while (extra != NULL)
+	{
+		PQclear (extra);
+		extra = PQgetResult (conn);
+	}
+	dbwait += clock_seconds () - t;
 
 	/* Ignore success. */
 	pstat = PQresultStatus(res);
@@ -467,6 +784,68 @@ pcmd (PGconn *conn, char *cmd)
 	return (res);
 }
 
+/* Export snapshot of the transaction on the connection. */
+
+static char *
+export_snapshot (PGconn *conn)
+{
+	PGresult *res;
+	char *r;
+
+	res = pcmd (conn, "SELECT pg_export_snapshot()");
+	r = strdup (PQgetvalue (res, 0, 0));
+	if (r == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+	PQclear (res);
+	return (r);
+}
+
+/* Open another connection reading the snapshot given, read only unless
+   it should also run the -Q statements. */
+
+static PGconn *
+open_scan_connection (char *snapshot, int readonly)
+{
+	PGconn *conn;
+	PGresult *res;
+	char *set_select;
+	char *set_cmd;
+
+	conn = PQconnectdb (connect_string);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		perr (CANTCONNECT, conn, "Cannot connect as %s",
+			connect_string);
+	}
+
+	/* Importing a snapshot needs repeatable read. */
+	res = pcmd (conn, readonly ?
+		"BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY" :
+		"BEGIN ISOLATION LEVEL REPEATABLE READ");
+	PQclear (res);
+	set_select = "SET TRANSACTION SNAPSHOT '%s'";
+	set_cmd = (char *) allocate (strlen (set_select) + strlen (snapshot) + 1);
+	(void) sprintf (set_cmd, set_select, snapshot);
+	res = pcmd (conn, set_cmd);
+	PQclear (res);
+	free (set_cmd);
+	return (conn);
+}
+
+/* Close connection opened with open_scan_connection. */
+
+static void
+close_scan_connection (PGconn *conn)
+{
+	PGresult *res;
+
+	res = PQexec (conn, "ROLLBACK");
+	PQclear (res);
+	PQfinish (conn);
+}
+
 /* Postgres handle definition. */
 typedef struct pghandle {
 
@@ -490,14 +869,157 @@ typedef struct pghandle {
 
 	/* Number of fields returned. */
 	int nfields;
+
+	/* Next fetch was sent and the result is not collected yet. */
+	int pending;
+
+	/* Result format, 0 text, 1 binary. */
+	int format;
+
+	/* Name of the prepared declare statement, NULL if none. */
+	char *stmt_name;
+
+	/* Cursor is open. */
+	int open;
+
+	/* Cursor name. */
+	char *name;
+
+	/* Rows to ask for in the next fetch and in the one the result is
+	   for. */
+	int fetchcount;
+	int asked;
+
+	/* The last fetch was short, the cursor is at its end. */
+	int done;
+
+	/* Directories or files, for the fetch size statistics. */
+	int kind;
+
+	/* Select with parameter $1 of which the plan is still to be
+	   captured, NULL if none. */
+	char *plan_select;
 } pghandle_t;
 
+/* Kinds of cursors. */
+#define KIND_DIRS ((int) 0)
+#define KIND_FILES ((int) 1)
+
+/* Fetch size statistics buckets, powers of two. */
+#define FETCH_BUCKETS ((int) 21)
+
+/* Fetches by kind and size. */
+static long long unsigned fetch_sizes[2][FETCH_BUCKETS];
+
+/* Kinds of statements timed. */
+#define STAT_OPEN ((int) 0)		/* Cursor declared or opened */
+#define STAT_FETCH ((int) 1)	/* Fetch from a cursor */
+#define STAT_CLOSE ((int) 2)	/* Cursor closed */
+#define STAT_QUERY ((int) 3)	/* Keyset page or counting query */
+#define STAT_SQL ((int) 4)		/* The -Q statement */
+#define STAT_KINDS ((int) 5)
+
+/* Latency buckets, powers of two microseconds. */
+#define STAT_BUCKETS ((int) 32)
+
+/* Statements of a kind. */
+typedef struct stmtstat {
+
+	/* Number of statements, rows and result bytes. */
+	long long unsigned n;
+	long long unsigned rows;
+	long long unsigned bytes;
+
+	/* Seconds they took, in all and the longest. */
+	double time;
+	double max;
+
+	/* Statements by latency. */
+	long long unsigned latency[STAT_BUCKETS];
+} stat_t;
+
+/* Statements by kind. */
+static stat_t stats[STAT_KINDS];
+
+/* Print the statement statistics in the summary. */
+static boolean print_stats = false;
+
+/* File the plans of the scan queries are appended to, -1 for none. */
+static int plan_fd = -1;
+
+/* Names of the kinds of statements. */
+static char *stat_names[STAT_KINDS] = {"open", "fetch", "close", "query", "-Q"};
+
+/* Bytes of memory a result takes. Before libpq 12 it is estimated from
+   the lengths of the values, with the pointer and length libpq keeps
+   for every value. */
+
+static size_t
+result_size (PGresult *res)
+{
+#if PG_VERSION_NUM >= 120000
+	return (PQresultMemorySize (res));
+#else
+	size_t r;
+	int i;
+	int j;
+
+	r = (size_t) 0;
+	for (i=0; i<PQntuples (res); i++)
+	{
+		for (j=0; j<PQnfields (res); j++)
+		{
+			r += (size_t) PQgetlength (res, i, j) + 1 + sizeof (char *) +
+				sizeof (int);
+		}
+	}
+	return (r);
+#endif
+}
+
+/* Note a statement of a kind which took t seconds, with its result if
+   there is one. */
+
+static void
+count_stat (int kind, double t, PGresult *res)
+{
+	stat_t *st;
+	double us;
+	int b;
+
+	st = stats + kind;
+	st->n++;
+	if (res != NULL)
+	{
+		st->rows += (long long unsigned) PQntuples (res);
+		st->bytes += (long long unsigned) result_size (res);
+	}
+	st->time += t;
+	if (t > st->max)
+	{
+		st->max = t;
+	}
+	b = 0;
+	for (us = t * 1000000.0; us >= 2.0 && b < STAT_BUCKETS - 1; us /= 2.0)
+	{
+		b++;
+	}
+	st->latency[b]++;
+}
+
 /* Our database connection info block. */
 typedef struct dbc {
 
 	/* Database connection handle. */
 	PGconn *conn;
 
+	/* Connections for the directory and the file cursors. */
+	PGconn *dconn;
+	PGconn *fconn;
+
+	/* Snapshot exported for the scan connections, NULL if none. */
+	char *snapshot;
+
 	/* Postgres exec result. */
 	PGresult *res;
 
@@ -511,6 +1033,10 @@ typedef struct dbc {
 	time_t starttime;
 	time_t endtime;
 
+	/* Start and end on the monotonic clock. */
+	double startclock;
+	double endclock;
+
 	/* Number of records seen. */
 	long long unsigned rno;
 
@@ -523,6 +1049,9 @@ typedef struct dbc {
 	/* Not UTF counted. */
 	long long unsigned nutfno;
 
+	/* Replicas left out, another replica of the object was seen. */
+	long long unsigned dupno;
+
 	/* Number of fetches. */
 	long long unsigned fetches;
 
@@ -548,15 +1077,21 @@ create_dbc (void)
 
 	r = new (dbc_t);
 	r->conn = NULL;
+	r->dconn = NULL;
+	r->fconn = NULL;
+	r->snapshot = NULL;
 	r->res = NULL;
 	r->hd = NULL;
 	r->hf = NULL;
 	r->starttime = (time_t) 0;
 	r->endtime = (time_t) 0;
+	r->startclock = 0.0;
+	r->endclock = 0.0;
 	r->rno = (long long unsigned) 0;
 	r->dno = (long long unsigned) 0;
 	r->fno = (long long unsigned) 0;
 	r->nutfno = (long long unsigned) 0;
+	r->dupno = (long long unsigned) 0;
 	r->fetches = (long long unsigned) 0;
 	r->total = (long long unsigned) 0;
 	r->last_command = (char *) allocate (COMMAND_LENGTH);
@@ -566,6 +1101,45 @@ create_dbc (void)
 	return (r);
 }
 
+/* Set up the directory and file scan connections. Prefetch and COPY
+   need connections of their own reading the snapshot, otherwise the
+   scans share the main connection. */
+
+static void
+open_scans (char *snapshot)
+{
+	dbc->dconn = dbc->conn;
+	dbc->fconn = dbc->conn;
+	if (prefetch || copyscan)
+	{
+		if (prefetch || dirsonly)
+		{
+			dbc->dconn = open_scan_connection (snapshot, true);
+		}
+		if (prefetch || ! dirsonly)
+		{
+			dbc->fconn = open_scan_connection (snapshot, true);
+		}
+	}
+}
+
+/* Close the scan connections other than the main connection. */
+
+static void
+close_scans (void)
+{
+	if (dbc->dconn != NULL && dbc->dconn != dbc->conn)
+	{
+		close_scan_connection (dbc->dconn);
+	}
+	if (dbc->fconn != NULL && dbc->fconn != dbc->conn)
+	{
+		close_scan_connection (dbc->fconn);
+	}
+	dbc->dconn = dbc->conn;
+	dbc->fconn = dbc->conn;
+}
+
 /* Return size string in SI units to print. */
 
 static char *
@@ -629,24 +1203,122 @@ printsize (long long unsigned total)
 	return (r);
 }
 
-/* Print summary. */
+/* Split collection report. */
+typedef struct split {
 
-static void
-print_summary (dbc_t *d)
-{
+	/* Collection name. */
+	char *name;
 
-	/* Bandwidth, bit / s. */
-	long long unsigned totalbps;
+	/* Number of files. */
+	long long unsigned files;
 
-	/* Total size string. */
-	char *totalsize;
+	/* Seconds it took. */
+	double seconds;
 
-	/* Total speed string. */
-	char *totalspeed;
+	/* Next one. */
+	struct split *next;
+} split_t;
+
+/* Collections split, in the order they were scanned. */
+static split_t *splits = NULL;
+static split_t **splits_tail = &splits;
+
+/* Print the split collections. */
+
+static void
+print_splits (void)
+{
+	split_t *sp;
+
+	for (sp = splits; sp != NULL; sp = sp->next)
+	{
+		msg ("%24.3f seconds %llu files split %s", sp->seconds, sp->files,
+			sp->name);
+	}
+}
+
+/* Print the number of fetches by size. */
+
+static void
+print_fetch_sizes (void)
+{
+	int i;
+	int j;
+
+	for (j=0; j<2; j++)
+	{
+		for (i=0; i<FETCH_BUCKETS; i++)
+		{
+			if (fetch_sizes[j][i] > 0)
+			{
+				msg ("%24llu %s fetches of %d to %d rows", fetch_sizes[j][i],
+					j == KIND_DIRS ? "directory" : "file", 1 << i,
+					(1 << (i + 1)) - 1);
+			}
+		}
+	}
+}
+
+/* Print the statements by kind with their latencies. */
+
+static void
+print_statistics (void)
+{
+	stat_t *st;
+	char *size;
+	int k;
+	int b;
+
+	for (k=0; k<STAT_KINDS; k++)
+	{
+		st = stats + k;
+		if (st->n == 0)
+		{
+			continue;
+		}
+		size = printsize (st->bytes);
+		msg ("%24llu %s statements, %llu rows, %s", st->n, stat_names[k],
+			st->rows, size + strspn (size, " "));
+		free (size);
+		msg ("%24.3f seconds in %s, %.3f ms mean, %.3f ms max", st->time,
+			stat_names[k], st->time * 1000.0 / (double) st->n,
+			st->max * 1000.0);
+		for (b=0; b<STAT_BUCKETS; b++)
+		{
+			if (st->latency[b] > 0)
+			{
+				msg ("%24llu %s in %.3f to %.3f ms", st->latency[b],
+					stat_names[k], b == 0 ? 0.0 : ldexp (1.0, b) / 1000.0,
+					ldexp (1.0, b + 1) / 1000.0);
+			}
+		}
+	}
+}
+
+/* Print summary. */
+
+static void
+print_summary (dbc_t *d)
+{
+
+	/* Bandwidth, bit / s. */
+	long long unsigned totalbps;
+
+	/* Total size string. */
+	char *totalsize;
+
+	/* Total speed string. */
+	char *totalspeed;
 
 	/* Duration time in seconds. */
 	long long unsigned duration;
 
+	/* Elapsed time on the monotonic clock. */
+	double elapsed;
+
+	/* Root index. */
+	int i;
+
 	msg ("%24llu records seen", d->rno);
 	msg ("%24llu directories", d->dno);
 	msg ("%24llu files", d->fno);
@@ -657,7 +1329,34 @@ print_summary (dbc_t *d)
 	{
 		msg ("%24llu malformed", d->nutfno);
 	}
+	if (d->dupno > 0)
+	{
+		msg ("%24llu replicas left out", d->dupno);
+	}
+	if (write_group > 0)
+	{
+		msg ("%24lu SQL statements committed", nsqlstmt);
+	}
+	else if (sqlstmt != NULL && ! test)
+	{
+		msg ("%24lu SQL statements", nsqlstmt);
+		msg ("%24llu rows of SQL statements", nsqlrows);
+	}
+	if (nsqlfailed > 0)
+	{
+		msg ("%24lu SQL statements failed", nsqlfailed);
+	}
 	free (totalsize);
+	if (nroots > 1)
+	{
+		for (i=0; i<nroots; i++)
+		{
+			totalsize = printsize (roots[i].total);
+			msg ("%24llu files, %s in %s", roots[i].fno,
+				totalsize + strspn (totalsize, " "), roots[i].name);
+			free (totalsize);
+		}
+	}
 	duration = (long long unsigned) (d->endtime - d->starttime);
 	if (duration == 0)
 	{
@@ -672,1095 +1371,6372 @@ print_summary (dbc_t *d)
 		msg ("%24s / second", totalspeed);
 		free (totalspeed);
 	}
+	elapsed = d->endclock - d->startclock;
+	if (nparts > 0)
+	{
+		msg ("%24d parallel scan connections", nparts);
+	}
+	print_splits ();
+	if (adaptive)
+	{
+		print_fetch_sizes ();
+	}
+	if (print_stats)
+	{
+		print_statistics ();
+	}
+	msg ("%24.3f seconds blocked on database", dbwait);
+	if (elapsed > 0.0)
+	{
+		msg ("%23.1f%% of elapsed time blocked on database",
+			100.0 * dbwait / elapsed);
+	}
 }
 
 /* Maximum length of SQL statement. */
 #define MAX_SQL_STMT ((int) 65535)
 
-/* Execute SQL statement for an object. */
-
-static void
-execute_sqlstmt (PGconn *conn, char *sql, long long unsigned id, char *path)
-{
-	int status;
+/* Postgres type oid for bigint and bigint[]. */
+#define INT8OID ((Oid) 20)
+#define INT8ARRAYOID ((Oid) 1016)
 
-	/* Postgres exec result. */
-	PGresult *res;
+/* Type of the parameter of the -Q statement. */
+#define SQLSTMT_TYPE (sqlbatch > 0 ? INT8ARRAYOID : INT8OID)
 
-	/* Statement length. */
-	size_t s;
+/* Name of the prepared statement for -Q. */
+#define SQLSTMT_NAME "ifind_sql"
 
-	/* Postgresql statement. */
-	char stmt[MAX_SQL_STMT];
+/* SQL statement with the id as parameter $1, once prepared. */
+static char *sqlprepared = NULL;
 
-	/* The SQL string should accomodate the ID and a bit more. */
-	s = (size_t) MAX_SQL_STMT - (size_t) (log10 (ULLONG_MAX) + 2)
-		- (size_t) 16;
+/* The -Q statement cannot be prepared, it runs as text with the id
+   edited in. */
+static boolean sqltext = false;
 
-	/* It should have proper format string included. */
-	if (strstr (sql, "%llu") == NULL)
-	{
-		err (FAILURE, "SQL statement string does not have %llu for id");
-	}
+/* Encode id as a binary bigint parameter. */
 
-	/* Edit id into the string. */
-	status = snprintf (stmt, s, sql, id);
-	if (status > (int) s)
-	{
+static void
+id_param (char *buf, long long unsigned id)
+{
+	int i;
 
-		/* Fail out if too long and truncated. */
-		err (FAILURE, "SQL statement string %s too long", stmt);
-	}
-	if (status < 0)
+	for (i=7; i>=0; i--)
 	{
-		err (FAILURE, "Function snprintf failed %d - confused", status);
+		buf[i] = (char) (id & 0xff);
+		id >>= 8;
 	}
+}
 
-	/* We got the SQL statement, execute. */
-	if (debug > 5)
-	{
-		msg ("SQL '%s' for %s", stmt, path);
-	}
-	if (test)
-	{
-		msg ("%s", stmt);
-	}
-	else
-	{
+/* Execute prepared statement with an id as the only parameter, the
+   result is not checked. */
 
-		/* Execute SQL command. */
-		res = pcmd (conn, stmt);
-		PQclear (res);
-		nsqlstmt++;
-	}
+static PGresult *
+exec_prepared (PGconn *conn, char *name, long long unsigned id)
+{
+	PGresult *res;
+	char param[8];
+	const char *values[1];
+	int lengths[1];
+	int formats[1];
+	double t;
+
+	/* The id is sent as a binary bigint, no formatting. */
+	id_param (param, id);
+	values[0] = param;
+	lengths[0] = 8;
+	formats[0] = 1;
+	t = clock_seconds ();
+	res = PQexecPrepared (conn, name, 1, values, lengths, formats, 0);
+	dbwait += clock_seconds () - t;
+	return (res);
 }
 
-/* Issue select for directories. */
+/* Execute prepared statement with an id as the only parameter. */
 
-static pghandle_t *
-select_directories (PGconn *conn, int sorted, int fetchcount,
-	char *directory)
+static PGresult *
+pcmd_prepared (PGconn *conn, char *name, long long unsigned id)
 {
+	PGresult *res;
+	ExecStatusType pstat;
 
-	/* Postgres handle returned. */
-	pghandle_t *r;
+	res = exec_prepared (conn, name, id);
+	pstat = PQresultStatus(res);
+	if (pstat != PGRES_COMMAND_OK && pstat != PGRES_TUPLES_OK)
+	{
+		perr (PGRESEXEC, conn, "Error %s executing '%s' for %llu",
+			PQresStatus(pstat), name, id);
+	}
+	return (res);
+}
 
-	/* Wildchars to append for database LIKE string. */
-	/* With a trailing slash it would be like char *wild = "/%"; */
-	char *wild = "%";
+/* Prepare statement with a parameter of the type. */
 
-	/* Database LIKE string length. */
-	size_t like_len;
+static void
+prepare (PGconn *conn, char *name, char *stmt, Oid type)
+{
+	PGresult *res;
+	Oid types[1];
 
-	/* Database LIKE string. */
-	char *like;
+	types[0] = type;
+	res = PQprepare (conn, name, stmt, 1, types);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		perr (PGRESEXEC, conn, "Error %s preparing '%s'",
+			PQresStatus(PQresultStatus(res)), stmt);
+	}
+	PQclear (res);
+}
 
-	/* Collections select statement sprintf string. */
-	char *colls_select;
+/* Number of reconnect attempts for the keyset scan. */
+#define KEYSET_RECONNECTS ((int) 16)
 
-	/* Collections select statement command created. */
-	char *colls_cmd;
+/* Maximum delay between reconnect attempts, seconds. */
+#define KEYSET_MAX_DELAY ((int) 60)
 
-	/* Fetch select statement string. */
-	char *fetch_select;
+/* Reconnect after the connection was lost. */
 
-	/* Fetch command. */
-	char *fetch_cmd;
+static void
+reconnect (PGconn *conn)
+{
+	int i;
+	int delay;
 
-	/* Close command. */
-	char *close_cmd;
+	delay = 1;
+	for (i=0; i<KEYSET_RECONNECTS; i++)
+	{
+		(void) fprintf (stderr, "Connection lost, reconnecting in %d s\n",
+			delay);
+		(void) fflush (stderr);
+		(void) sleep (delay);
+		PQreset (conn);
+		if (PQstatus (conn) == CONNECTION_OK)
+		{
 
-	/* Postgres exec result. */
-	PGresult *res;
+			/* Prepared statements are gone with the old session. */
+			if (sqlprepared != NULL && ! test && write_group == 0)
+			{
+				prepare (conn, SQLSTMT_NAME, sqlprepared, SQLSTMT_TYPE);
+			}
+			msg ("Reconnected, continuing after '%s'", dbc->last_path);
+			return;
+		}
+		delay = delay * 2 > KEYSET_MAX_DELAY ? KEYSET_MAX_DELAY : delay * 2;
+	}
+	perr (CANTCONNECT, conn, "Cannot reconnect after %d attempts",
+		KEYSET_RECONNECTS);
+}
 
-	/* Create handle. */
-	r = new (pghandle_t);
+/* Can the -Q statement not be prepared. The id is edited into quoted
+   strings and identifiers too, and several statements separated by
+   semicolons run in one go, which a prepared statement cannot do. */
 
-	/* Build search string. Will add a LIKE clause. */
-	like_len = (size_t) (strlen (directory) + strlen(wild));
-	like = (char *) allocate (like_len + 1);
-	*like = EOS;
-	(void) strcpy (like, directory);
-	(void) strcat (like, wild);
+static int
+sqlstmt_is_text (char *sql)
+{
+	char *ip;
+	char quote;
 
-	/* Build sprintf string to create select statement. */
-	colls_select = "DECLARE c CURSOR FOR SELECT coll_id,coll_name FROM \
-r_coll_main WHERE coll_name LIKE '%s'";
+	quote = EOS;
+	for (ip = sql; *ip != EOS; ip++)
+	{
+		if (strncmp (ip, "%%", 2) == 0)
+		{
+			ip++;
+		}
+		else if (strncmp (ip, "%llu", 4) == 0 && quote != EOS)
+		{
+			return (true);
+		}
+		else if (quote != EOS)
+		{
+			if (*ip == quote)
+			{
+				quote = EOS;
+			}
+		}
+		else if (*ip == '\'' || *ip == '"')
+		{
+			quote = *ip;
+		}
+		else if (*ip == ';' && ip[strspn (ip + 1, " \t\n") + 1] != EOS)
+		{
+			return (true);
+		}
+	}
+	return (false);
+}
 
-	/* Create sprintf target, should be long enough. */
-	colls_cmd = (char *) allocate (strlen (colls_select) + like_len + 1024);
+/* Turn the -Q statement into one with parameter $1 for the id, or with
+   the id edited in as text when it is not prepared. A doubled percent
+   sign is one as with printf. */
 
-	/* Create SQL statement. */
-	(void) sprintf (colls_cmd, colls_select, like);
-	free (like);
+static char *
+sqlstmt_param (char *sql, char *id)
+{
+	char *r;
+	char *ip;
+	char *op;
 
-	/* Add sort clause if specified. */
-	if (sorted == 0)
+	/* It should have proper format string or parameter included. */
+	if (strstr (sql, "%llu") == NULL && (sqltext || strstr (sql, "$1") == NULL))
 	{
-		;
+		err (FAILURE, "SQL statement string does not have %llu for id");
 	}
-	else if (sorted == 1)
+	if (strlen (sql) >= (size_t) MAX_SQL_STMT)
 	{
-		strcat (colls_cmd,  " ORDER BY coll_name ASC");
+		err (FAILURE, "SQL statement string %s too long", sql);
 	}
-	else if (sorted == 2)
+
+	/* An id is at most 20 digits for every %llu. */
+	r = (char *) allocate (5 * strlen (sql) + 1);
+	ip = sql;
+	op = r;
+	while (*ip != EOS)
 	{
-		strcat (colls_cmd,  " ORDER BY coll_name DESC");
+		if (strncmp (ip, "%%", 2) == 0)
+		{
+			*op++ = '%';
+			ip += 2;
+		}
+		else if (strncmp (ip, "%llu", 4) == 0)
+		{
+			op += sprintf (op, "%s", id);
+			ip += 4;
+		}
+		else
+		{
+			*op++ = *ip++;
+		}
 	}
-	else if (sorted == 3)
-	{
+	*op = EOS;
+	return (r);
+}
 
-		/* Directories are always unique. */
-		strcat (colls_cmd,  " ORDER BY coll_name ASC");
+/* Execute the -Q statement as text with the id edited in. */
+
+static void
+execute_sqltext (PGconn *conn, char *sql, char *param, char *path)
+{
+	PGresult *res;
+	char *stmt;
+	double t;
+
+	stmt = sqlstmt_param (sql, param);
+	if (debug > 5)
+	{
+		msg ("SQL '%s' for %s", stmt, path);
 	}
-	else if (sorted == 4)
+	if (test)
 	{
-
-		/* Directories are always unique. */
-		strcat (colls_cmd,  " ORDER BY coll_name DESC");
+		msg ("%s", stmt);
 	}
 	else
 	{
-		err (FAILURE, "Wrong sort option %d", sorted);
+		t = clock_seconds ();
+		res = pcmd (conn, stmt);
+		count_stat (STAT_SQL, clock_seconds () - t, res);
+		nsqlrows += (long long unsigned) atoll (PQcmdTuples (res));
+		PQclear (res);
+		nsqlstmt++;
 	}
+	free (stmt);
+}
 
-	/* Build fetch SQL statement similarly. */
-	fetch_select = "FETCH %d FROM c";
-	fetch_cmd = (char *) allocate (strlen (fetch_select) + 1024);
-	(void) sprintf (fetch_cmd, fetch_select, fetchcount);
+/* Groups of statements in flight on the write connection before
+   waiting for the oldest to commit. */
+#define WRITE_GROUPS ((int) 4)
+
+/* Kinds of entries sent on the write connection. */
+#define WRITE_STMT ((int) 0)
+#define WRITE_FAILED ((int) 1)
+#define WRITE_SYNC ((int) 2)
+
+/* Write connection in pipeline mode, NULL until the first statement. */
+static PGconn *wconn = NULL;
+
+/* Pipeline mode is in libpq 14 and later. */
+#ifdef LIBPQ_HAS_PIPELINING
+
+/* A statement or the end of a group sent on the write connection. */
+typedef struct wentry {
+	long long unsigned id;
+	int kind;
+} wentry_t;
+
+/* Entries sent and not committed yet, a ring. The oldest is at whead,
+   the first without its result at wread, the next sent goes to wtail. */
+static wentry_t *wring = NULL;
+static size_t wring_size = 0;
+static size_t whead = 0;
+static size_t wread = 0;
+static size_t wtail = 0;
+
+/* The result of the entry at wread was read, its end is next. */
+static int wresult = false;
+
+/* Statements in the group being sent, groups sent and not committed,
+   the oldest failed, and when the group started. */
+static int wgroup_n = 0;
+static int wgroups = 0;
+static int wgroup_failed = false;
+static double wgroup_start = 0.0;
+
+/* Ids rolled back with a failed statement to send again. */
+static long long unsigned *wretry = NULL;
+static size_t wretry_size = 0;
+static size_t nwretry = 0;
+
+/* Open the write connection. It is not in the snapshot, the statements
+   commit in groups on their own while the scan goes on. */
 
-	/* Close command. */
-	close_cmd = strdup ("CLOSE c");
-	if (close_cmd == NULL)
+static void
+open_write_connection (void)
+{
+	wconn = PQconnectdb (connect_string);
+	if (PQstatus(wconn) != CONNECTION_OK)
 	{
-		err (FAILURE, "Function strdup failed");
+		perr (CANTCONNECT, wconn, "Cannot connect as %s", connect_string);
 	}
+	prepare (wconn, SQLSTMT_NAME, sqlprepared, SQLSTMT_TYPE);
 
-	/* Issue the SQL. */
-	res = pcmd (conn, colls_cmd);
-	PQclear (res);
-
-	/* Update return object. */
-	r->conn = conn;
-	r->res = NULL;
-	r->select_cmd = colls_cmd;
-	r->fetch_cmd = fetch_cmd;
-	r->close_cmd = close_cmd;
-	r->nrows = 0;
-	r->nfields = 0;
-	return (r);
+	/* Sending does not block, so the results are read while the server
+	   would wait for us to read them. */
+	if (PQsetnonblocking (wconn, 1) != 0 || PQenterPipelineMode (wconn) == 0)
+	{
+		perr (PGRESEXEC, wconn, "Cannot enter pipeline mode");
+	}
+	wgroup_start = clock_seconds ();
 }
 
-/* Issue select for files in a directory. */
+/* Note an id to send again. */
 
-static pghandle_t *
-select_files (PGconn *conn, int sorted, int fetchcount,
-	char *directory)
+static void
+write_retry (long long unsigned id)
 {
+	long long unsigned *a;
 
-	/* Postgres handle returned. */
-	pghandle_t *r;
-
-	/* Files select statement sprintf string. */
-	char *files_select;
-
-	/* Length. */
-	size_t files_len;
+	if (nwretry == wretry_size)
+	{
+		wretry_size = wretry_size > 0 ? 2 * wretry_size : 1024;
+		a = (long long unsigned *) allocate (wretry_size *
+			sizeof (long long unsigned));
+		if (nwretry > 0)
+		{
+			memcpy (a, wretry, nwretry * sizeof (long long unsigned));
+		}
+		free (wretry);
+		wretry = a;
+	}
+	wretry[nwretry++] = id;
+}
 
-	/* Files select statement command created. */
-	char *files_cmd;
+/* Confirm the oldest group at its end. Without a failure it committed,
+   else all of it was rolled back and the statements but the failed ones
+   are sent again. */
 
-	/* Fetch select statement string. */
-	char *fetch_select;
+static void
+write_confirm (void)
+{
+	wentry_t *e;
 
-	/* Fetch command. */
-	char *fetch_cmd;
+	for (; whead<wread; whead++)
+	{
+		e = &wring[whead % wring_size];
+		if (e->kind == WRITE_STMT)
+		{
+			if (wgroup_failed)
+			{
+				write_retry (e->id);
+			}
+			else
+			{
+				nsqlstmt++;
+			}
+		}
+	}
+	whead++;
+	wread++;
+	wgroups--;
+	wgroup_failed = false;
+}
 
-	/* Close command. */
-	char *close_cmd;
+/* Read the results the write connection has without waiting. */
 
-	/* Postgres exec result. */
+static void
+write_results (void)
+{
 	PGresult *res;
+	ExecStatusType pstat;
+	wentry_t *e;
 
-	/* Create handle. */
-	r = new (pghandle_t);
-
-	/* Build sprintf string to create select statement. */
-	if (sorted == 3 || sorted == 4)
+	if (PQconsumeInput (wconn) == 0)
 	{
-
-		/* Unique file names. */
-		files_select =
-			"DECLARE d CURSOR FOR SELECT DISTINCT ON (data_name) \
-data_id,data_size,data_name \
-FROM r_data_main WHERE coll_id=%s";
+		perr (PGRESEXEC, wconn, "Error reading results of '%s'",
+			sqlprepared);
 	}
-	else
+	while (wread != wtail && ! PQisBusy (wconn))
 	{
+		res = PQgetResult (wconn);
+		e = &wring[wread % wring_size];
+		if (e->kind == WRITE_SYNC)
+		{
+			if (PQresultStatus (res) != PGRES_PIPELINE_SYNC)
+			{
+				perr (PGRESEXEC, wconn, "Error %s ending a group - confused",
+					PQresStatus (PQresultStatus (res)));
+			}
+			PQclear (res);
+			write_confirm ();
+		}
+		else if (res == NULL)
+		{
 
-		/* Default case, show all matches. There will be replicas. */
-		files_select = "DECLARE d CURSOR FOR SELECT \
-data_id,data_size,data_name \
-FROM r_data_main WHERE coll_id=%s";
-	}
-	files_len = (size_t) (strlen (files_select) +
-		strlen(directory));
+			/* End of the results of a statement. */
+			wresult = false;
+			wread++;
+		}
+		else
+		{
+			pstat = PQresultStatus (res);
+			if (! wresult && pstat == PGRES_FATAL_ERROR)
+			{
 
-	/* Create sprintf target, should be long enough. */
-	files_cmd = (char *) allocate (strlen (files_select) + files_len +
-		1024);
+				/* Report it, the others of the group are sent again. */
+				(void) fprintf (stderr, "Error executing '%s' for %llu: %s",
+					sqlprepared, e->id, PQresultErrorMessage (res));
+				e->kind = WRITE_FAILED;
+				nsqlfailed++;
+				wgroup_failed = true;
+			}
+			else if (pstat != PGRES_COMMAND_OK &&
+				pstat != PGRES_TUPLES_OK && pstat != PGRES_PIPELINE_ABORTED)
+			{
+				perr (PGRESEXEC, wconn, "Error %s executing '%s' for %llu",
+					PQresStatus (pstat), sqlprepared, e->id);
+			}
+			wresult = true;
+			PQclear (res);
+		}
+	}
+}
 
-	/* Create SQL statement. */
-	(void) sprintf (files_cmd, files_select, directory);
+/* Wait until the write connection can be read, or written too. */
 
-	/* Add resource clause when needed. */
-	if (resource != NULL)
+static void
+write_wait (int writing)
+{
+	fd_set rfds;
+	fd_set wfds;
+	int sock;
+	double t;
+
+	t = clock_seconds ();
+	sock = PQsocket (wconn);
+	FD_ZERO (&rfds);
+	FD_SET (sock, &rfds);
+	FD_ZERO (&wfds);
+	if (writing)
 	{
-		strcat (files_cmd, " AND RESC_NAME = '");
-		strcat (files_cmd, resource);
-		strcat (files_cmd, "'");
+		FD_SET (sock, &wfds);
+	}
+	if (select (sock + 1, &rfds, &wfds, NULL, NULL) < 0 && errno != EINTR)
+	{
+		err (FAILURE, "Function select failed - confused");
 	}
+	dbwait += clock_seconds () - t;
+}
 
-	/* Add replica clause if specified. The replica number is actually
-	   a string! */
-	if (replica != NULL)
+/* Send what libpq has buffered, reading the results meanwhile. */
+
+static void
+write_flush (void)
+{
+	int r;
+
+	r = PQflush (wconn);
+	while (r == 1)
+	{
+		write_wait (true);
+		write_results ();
+		r = PQflush (wconn);
+	}
+	if (r < 0)
 	{
+		perr (PGRESEXEC, wconn, "Error sending '%s'", sqlprepared);
+	}
+	write_results ();
+}
 
-		/* Replica number was specified. */
-		strcat (files_cmd, " AND DATA_REPL_NUM = '");
-		strcat (files_cmd, replica);
-		strcat (files_cmd, "'");
+/* Add an entry to the ring, making it larger when full. */
+
+static void
+write_entry (long long unsigned id, int kind)
+{
+	wentry_t *ring;
+	size_t size;
+	size_t i;
+
+	if (wtail - whead == wring_size)
+	{
+		size = wring_size > 0 ? 2 * wring_size : 4096;
+		ring = (wentry_t *) allocate (size * sizeof (wentry_t));
+		for (i=whead; i<wtail; i++)
+		{
+			ring[i % size] = wring[i % wring_size];
+		}
+		free (wring);
+		wring = ring;
+		wring_size = size;
 	}
+	wring[wtail % wring_size].id = id;
+	wring[wtail % wring_size].kind = kind;
+	wtail++;
+}
 
-	/* Add sort clause if specified. */
-	if (sorted == 0)
+/* End the group being sent, the server commits it at the end. Waits for
+   the oldest groups when too many are in flight. */
+
+static void
+write_sync (void)
+{
+	if (wgroup_n == 0)
 	{
-		;
+		return;
 	}
-	else if (sorted == 1)
+	if (PQpipelineSync (wconn) == 0)
 	{
-		strcat (files_cmd,  " ORDER BY data_name ASC");
+		perr (PGRESEXEC, wconn, "Error ending a group of '%s'", sqlprepared);
 	}
-	else if (sorted == 2)
+	write_entry (0, WRITE_SYNC);
+	wgroup_n = 0;
+	wgroups++;
+	wgroup_start = clock_seconds ();
+	write_flush ();
+	while (wgroups > WRITE_GROUPS)
 	{
-		strcat (files_cmd,  " ORDER BY data_name DESC");
+		write_wait (false);
+		write_results ();
 	}
-	else if (sorted == 3)
+}
+
+/* Send a statement for an id on the write connection. */
+
+static void
+write_send (long long unsigned id)
+{
+	char param[8];
+	const char *values[1];
+	int lengths[1];
+	int formats[1];
+
+	id_param (param, id);
+	values[0] = param;
+	lengths[0] = 8;
+	formats[0] = 1;
+	if (PQsendQueryPrepared (wconn, SQLSTMT_NAME, 1, values, lengths,
+		formats, 0) == 0)
 	{
-		strcat (files_cmd,  " ORDER BY data_name ASC");
+		perr (PGRESEXEC, wconn, "Error sending '%s' for %llu", sqlprepared,
+			id);
 	}
-	else if (sorted == 4)
+	write_entry (id, WRITE_STMT);
+	wgroup_n++;
+	if (wgroup_n >= write_group || (write_seconds > 0.0 &&
+		clock_seconds () - wgroup_start >= write_seconds))
 	{
-		strcat (files_cmd,  " ORDER BY data_name DESC");
+		write_sync ();
 	}
 	else
 	{
-		err (FAILURE, "Wrong sort option");
+		write_flush ();
 	}
+}
 
-	/* Build fetch SQL statement similarly. */
-	fetch_select = "FETCH %d FROM d";
-	fetch_cmd = (char *) allocate (strlen (fetch_select) + 1024);
-	(void) sprintf (fetch_cmd, fetch_select, fetchcount);
+/* Send a statement and those to send again. */
 
-	/* Close command. */
-	close_cmd = strdup ("CLOSE d");
-	if (close_cmd == NULL)
+static void
+write_sqlstmt (long long unsigned id)
+{
+	if (wconn == NULL)
 	{
-		err (FAILURE, "Function strdup failed");
+		open_write_connection ();
+	}
+	write_send (id);
+	while (nwretry > 0)
+	{
+		write_send (wretry[--nwretry]);
 	}
-
-	/* Issue the SQL. */
-	res = pcmd (conn, files_cmd);
-	PQclear (res);
-
-	/* Update return object. */
-	r->conn = conn;
-	r->res = NULL;
-	r->select_cmd = files_cmd;
-	r->fetch_cmd = fetch_cmd;
-	r->close_cmd = close_cmd;
-	r->nrows = 0;
-	r->nfields = 0;
-	return (r);
 }
 
-/* Issue fetch. */
+/* Commit the last group and wait for all of them. */
 
 static void
-fetch (pghandle_t *h)
+drain_write_connection (void)
 {
-
-	/* Free memory from the previous fetch if any. */
-	PQclear (h->res);
-
-	/* Issue the fetch. */
-	h->res = pcmd (h->conn, h->fetch_cmd);
-
-	/* Update indicators. */
-	h->nfields = PQnfields (h->res);
-	h->nrows = PQntuples (h->res);
-	if (debug > 5)
+	if (wconn == NULL)
 	{
-		if (h->nrows != 0)
+		return;
+	}
+	write_sync ();
+	while (wgroups > 0 || nwretry > 0)
+	{
+		while (nwretry > 0)
 		{
-			msg ("    %s %8d", h->fetch_cmd, h->nrows);
+			write_send (wretry[--nwretry]);
+		}
+		write_sync ();
+		if (wgroups > 0)
+		{
+			write_wait (false);
+			write_results ();
 		}
 	}
 }
 
-/* Issue close cursor and finish select. */
+/* Commit the statements sent and close the write connection. */
 
 static void
-closecursor (pghandle_t *h)
+close_write_connection (void)
 {
+	if (wconn == NULL)
+	{
+		return;
+	}
+	drain_write_connection ();
+	(void) PQexitPipelineMode (wconn);
+	PQfinish (wconn);
+	wconn = NULL;
+}
 
-	/* Issue the close cursor. */
-	h->res = pcmd (h->conn, h->close_cmd);
+/* Leave the write connection and what was sent on it to the parent,
+   in a child scan. */
 
-	/* Free memory. */
-	PQclear (h->res);
+static void
+forget_write_connection (void)
+{
+	wconn = NULL;
+	whead = 0;
+	wread = 0;
+	wtail = 0;
+	wresult = false;
+	wgroup_n = 0;
+	wgroups = 0;
+	wgroup_failed = false;
+	nwretry = 0;
+}
 
-	/* Free more memory. */
-	h->conn = NULL;
-	h->res = NULL;
-	free (h->select_cmd);
-	free (h->fetch_cmd);
-	free (h->close_cmd);
-	h->select_cmd = NULL;
-	h->fetch_cmd = NULL;
-	h->close_cmd = NULL;
-	h->nrows = 0;
-	h->nfields = 0;
-	free (h);
+#else
+
+/* Without pipeline mode -w is refused, nothing is sent. */
+
+static void
+write_sqlstmt (long long unsigned id)
+{
 }
 
-/* Show progress */
+static void
+drain_write_connection (void)
+{
+}
 
 static void
-show_progress (long long unsigned fetches)
+close_write_connection (void)
 {
-	if (progress > 0)
-	{
+}
 
-		/* We got the number of fetches, one fetch should get batchsize
-		   records, sometimes less. */
-		if ((fetches % ((long long unsigned) progress)) ==
-			(long long unsigned) 0)
-		{
-			pmsg (".");
-		}
-	}
+static void
+forget_write_connection (void)
+{
 }
 
-/* Check if pathname is a UTF-8 string. */
+#endif
 
-static int
-is_utf (char *pathname)
+/* Print the statement with the parameter edited in, for test and
+   debug. */
+
+static void
+print_sqlstmt (char *param, char *path, int debugging)
 {
-	size_t l;
+	char *ip;
 
-	l = mbstowcs (NULL, pathname, 0);
-	if (l == (size_t) -1)
+	pmsg ("%s", debugging ? "SQL '" : "");
+	for (ip = sqlprepared; *ip != EOS; ip++)
 	{
-		return (false);
+		if (ip[0] == '$' && ip[1] == '1' && ! isdigit ((unsigned char) ip[2]))
+		{
+			pmsg ("%s", param);
+			ip++;
+		}
+		else
+		{
+			pmsg ("%c", *ip);
+		}
+	}
+	if (debugging)
+	{
+		msg ("' for %s", path);
 	}
 	else
 	{
-		return (true);
+		msg ("");
 	}
 }
 
-/* Maximum number of tasks. */
-#define MAX_TASKS ((int) 64)
-
-/* Task descriptor. */
-typedef struct
-{
-
-	/* Task number. */
-	int no;
-
-	/* Task PID. */
-	pid_t pid;
-
-	/* Number of commands to execute. */
-	int ncmd;
+/* Ids collected for the next SQL statement. */
+static long long unsigned *batch_ids = NULL;
+static int nbatch_ids = 0;
 
-	/* Next command slot. */
-	int nextcmd;
+/* The ids as a bigint[] literal in text, '{id,...}', the parameter is
+   without the quotes. */
+static char *batch_param = NULL;
 
-	/* Array of commands. */
-	char **cmds;
-} task_t;
+/* Execute the statement with the ids collected, if any. */
 
-/* Work descriptor. */
-typedef struct
+static void
+flush_sqlbatch (PGconn *conn)
 {
+	PGresult *res;
+	char *op;
+	char what[64];
+	const char *values[1];
+	double t;
+	int i;
 
-	/* Number of tasks. */
-	int ntasks;
+	if (nbatch_ids == 0)
+	{
+		return;
+	}
+	op = batch_param;
+	*op++ = '\'';
+	*op++ = '{';
+	for (i=0; i<nbatch_ids; i++)
+	{
+		op += sprintf (op, i > 0 ? ",%llu" : "%llu", batch_ids[i]);
+	}
+	*op++ = '}';
+	*op++ = '\'';
+	*op = EOS;
+	(void) sprintf (what, "%d objects", nbatch_ids);
+	nbatch_ids = 0;
+	if (debug > 5)
+	{
+		print_sqlstmt (batch_param, what, true);
+	}
+	if (test)
+	{
+		print_sqlstmt (batch_param, what, false);
+		return;
+	}
 
-	/* Next task slot. */
-	int nexttask;
+	/* The array goes in text, the server parses it once. A lost
+	   connection in keyset mode is handled as for a single id. */
+	op[-1] = EOS;
+	values[0] = batch_param + 1;
+	t = clock_seconds ();
+	res = PQexecPrepared (conn, SQLSTMT_NAME, 1, values, NULL, NULL, 0);
+	while (keyset && PQresultStatus (res) == PGRES_FATAL_ERROR &&
+		PQstatus (conn) == CONNECTION_BAD)
+	{
+		PQclear (res);
+		reconnect (conn);
+		res = PQexecPrepared (conn, SQLSTMT_NAME, 1, values, NULL, NULL, 0);
+	}
+	dbwait += clock_seconds () - t;
+	count_stat (STAT_SQL, clock_seconds () - t, res);
+	if (PQresultStatus (res) != PGRES_COMMAND_OK &&
+		PQresultStatus (res) != PGRES_TUPLES_OK)
+	{
+		perr (PGRESEXEC, conn, "Error %s executing '%s' for %s",
+			PQresStatus (PQresultStatus (res)), sqlprepared, what);
+	}
+	nsqlrows += (long long unsigned) atoll (PQcmdTuples (res));
+	PQclear (res);
+	nsqlstmt++;
+}
 
-	/* Array of pointers to tasks. */
-	task_t **tasks;
+/* Execute SQL statement for an object. */
 
-	/* Running indicator. */
-	int running;
-} work_t;
+static void
+execute_sqlstmt (PGconn *conn, char *sql, long long unsigned id, char *path)
+{
 
-/* Global variable, work descriptor with tasks array. */
-work_t *work = NULL;
+	/* Postgres exec result. */
+	PGresult *res;
 
-/* Initialize task descriptor with n tasks, m commands each. */
+	/* Time the statement took. */
+	double t;
 
-static task_t **
-init_tasks (int n, int m)
-{
-	task_t **r;
-	int i;
-	int j;
+	/* The id in text. */
+	char param[32];
 
-	/* Check. */
-	if (n > MAX_TASKS)
+	/* Several statements or the id in quotes as before. */
+	if (sqltext)
 	{
-		err (FAILURE, "Too many tasks (%d) maximum %d",
-			n, MAX_TASKS);
+		(void) sprintf (param, "%llu", id);
+		execute_sqltext (conn, sql, param, path);
+		return;
 	}
 
-	/* Create array of pointers to tasks. */
-	r = (task_t **) allocate (n * sizeof (task_t *));
-
-	/* Allocate space for the commands array in all tasks. */
-	for (i=0; i<n; i++)
+	/* Prepare once, the server parses and plans it only once. */
+	if (sqlprepared == NULL)
 	{
-		r[i] = (task_t *) allocate (sizeof (task_t));
-		r[i]->no = i;
-		r[i]->pid = 0;
-		r[i]->ncmd = m;
-		r[i]->nextcmd = 0;
-		r[i]->cmds = (char **) allocate (m * sizeof (char *));
-		for (j=0; j<m; j++)
+		sqlprepared = sqlstmt_param (sql, "$1");
+		if (! test && write_group == 0)
 		{
-			r[i]->cmds[j] = (char *) allocate (COMMAND_LENGTH);
+			prepare (conn, SQLSTMT_NAME, sqlprepared, SQLSTMT_TYPE);
+		}
+		if (sqlbatch > 0)
+		{
+			batch_ids = (long long unsigned *) allocate ((size_t) sqlbatch *
+				sizeof (long long unsigned));
+			batch_param = (char *) allocate ((size_t) sqlbatch * 21 + 5);
 		}
 	}
-	return (r);
-}
 
-/* Create work descriptor. */
+	/* Collect the id, a statement for every batch of them. */
+	if (sqlbatch > 0)
+	{
+		batch_ids[nbatch_ids++] = id;
+		if (nbatch_ids == sqlbatch)
+		{
+			flush_sqlbatch (conn);
+		}
+		return;
+	}
 
-static work_t *
-create_work (int n, int m)
+	/* We got the SQL statement, execute. */
+	(void) sprintf (param, "%llu", id);
+	if (debug > 5)
+	{
+		print_sqlstmt (param, path, true);
+	}
+	if (test)
+	{
+		print_sqlstmt (param, path, false);
+	}
+	else
+	{
+
+		/* Pipelined on the write connection. */
+		if (write_group > 0)
+		{
+			write_sqlstmt (id);
+			return;
+		}
+
+		/* Execute SQL command. In keyset mode a lost connection is
+		   reestablished and the statement run again. */
+		t = clock_seconds ();
+		res = exec_prepared (conn, SQLSTMT_NAME, id);
+		while (keyset && PQresultStatus (res) == PGRES_FATAL_ERROR &&
+			PQstatus (conn) == CONNECTION_BAD)
+		{
+			PQclear (res);
+			reconnect (conn);
+			res = exec_prepared (conn, SQLSTMT_NAME, id);
+		}
+		count_stat (STAT_SQL, clock_seconds () - t, res);
+		if (PQresultStatus (res) != PGRES_COMMAND_OK &&
+			PQresultStatus (res) != PGRES_TUPLES_OK)
+		{
+			perr (PGRESEXEC, conn, "Error %s executing '%s' for %llu",
+				PQresStatus (PQresultStatus (res)), sqlprepared, id);
+		}
+		nsqlrows += (long long unsigned) atoll (PQcmdTuples (res));
+		PQclear (res);
+		nsqlstmt++;
+	}
+}
+
+/* Copy string into SQL literal, doubling quotes. When like, the LIKE
+   wildcards are escaped too. Returns the end of the output. */
+
+static char *
+sql_literal (char *op, char *ip, int like)
 {
-	work_t *r;
+	while (*ip != EOS)
+	{
+		if (*ip == '\'')
+		{
+			*op++ = '\'';
+		}
+		else if (like && (*ip == '%' || *ip == '_' || *ip == '\\'))
+		{
+			*op++ = '\\';
+		}
+		*op++ = *ip++;
+	}
+	*op = EOS;
+	return (op);
+}
 
-	r = new (work_t);
-	r->ntasks = n;
-	r->nexttask = 0;
-	r->tasks = init_tasks (n, m);
-	r->running = false;
+/* Copy a glob into a LIKE pattern literal. */
+
+static char *
+glob_like (char *op, char *ip)
+{
+	while (*ip != EOS)
+	{
+		if (*ip == '*')
+		{
+			*op++ = '%';
+		}
+		else if (*ip == '?')
+		{
+			*op++ = '_';
+		}
+		else
+		{
+			if (*ip == '\\' && ip[1] != EOS)
+			{
+				ip++;
+			}
+			if (*ip == '%' || *ip == '_' || *ip == '\\')
+			{
+				*op++ = '\\';
+			}
+			if (*ip == '\'')
+			{
+				*op++ = '\'';
+			}
+			*op++ = *ip;
+		}
+		ip++;
+	}
+	*op = EOS;
+	return (op);
+}
+
+/* Write the sort keys of a replica under the policy, with the data
+   columns prefixed with d. A smaller key is a better replica, the
+   replica number last makes the keys of an object unique. Returns the
+   end of the output. */
+
+static char *
+replica_keys_sql (char *op, char *d)
+{
+	char *policy;
+	char *token;
+	char *state;
+	char *resc;
+	char *rstate;
+	int high;
+	int i;
+
+	policy = strdup (replica_policy);
+	if (policy == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+	op += sprintf (op, "(");
+	high = false;
+	for (token = strtok_r (policy, ",", &state); token != NULL;
+		token = strtok_r (NULL, ",", &state))
+	{
+		if (strcmp (token, "good") == 0)
+		{
+
+			/* The dirty flag is 1 for a good replica. */
+			op += sprintf (op, "CASE WHEN %sdata_is_dirty=1 THEN 0 ELSE 1 END,",
+				d);
+		}
+		else if (strcmp (token, "high") == 0 || strcmp (token, "low") == 0)
+		{
+			high = strcmp (token, "high") == 0;
+		}
+		else if (strncmp (token, "resc=", 5) == 0)
+		{
+
+			/* The resources in the order given, others after them. */
+			op += sprintf (op, "CASE %sresc_name", d);
+			i = 0;
+			for (resc = strtok_r (token + 5, ":", &rstate); resc != NULL;
+				resc = strtok_r (NULL, ":", &rstate))
+			{
+				op += sprintf (op, " WHEN '");
+				op = sql_literal (op, resc, false);
+				op += sprintf (op, "' THEN %d", i++);
+			}
+			op += sprintf (op, " ELSE %d END,", i);
+		}
+		else
+		{
+			err (FAILURE, "Wrong replica preference %s", token);
+		}
+	}
+	op += sprintf (op, "%s%sdata_repl_num)", high ? "-" : "", d);
+	free (policy);
+	return (op);
+}
+
+static char *expr_filter_sql (char *d, char *coll);
+
+/* Build the condition keeping the best replica of every object under
+   the policy, with the data columns prefixed with d and coll the name
+   of their collection, or an empty string without a policy. A replica
+   is left out when the object has a better one, which is an index probe
+   on the data id per row, no sorting. */
+
+static char *
+replica_policy_sql (char *d, char *coll)
+{
+	char *r;
+	char *op;
+	char *where;
+
+	if (replica_policy == NULL || replica_any)
+	{
+		r = strdup ("");
+		if (r == NULL)
+		{
+			err (FAILURE, "Function strdup failed");
+		}
+		return (r);
+	}
+
+	/* The better replica has to be selected too. The metadata is of the
+	   object, the same for all its replicas. */
+	where = expr_filter_sql ("b.", coll);
+	r = (char *) allocate (64 * strlen (replica_policy) +
+		(resource != NULL ? 2 * strlen (resource) : 0) + strlen (where) +
+		1024);
+	op = r;
+	op += sprintf (op, " AND NOT EXISTS (SELECT 1 FROM r_data_main b \
+WHERE b.data_id=%sdata_id", d);
+	if (resource != NULL)
+	{
+		op += sprintf (op, " AND b.resc_name='");
+		op = sql_literal (op, resource, false);
+		op += sprintf (op, "'");
+	}
+	op += sprintf (op, "%s", where);
+	free (where);
+	op += sprintf (op, " AND ");
+	op = replica_keys_sql (op, "b.");
+	op += sprintf (op, "<");
+	op = replica_keys_sql (op, d);
+	op += sprintf (op, ")");
+	return (r);
+}
+
+/* Seconds the next incremental scan goes back before the start of
+   this one, for the changes committed later than their time stamps and
+   the clocks of the servers. */
+#define WATERMARK_SLACK ((long long) 300)
+
+/* Read the watermark of the incremental scan from the state file. When
+   there is none this scan is the full one. */
+
+static void
+read_watermark (void)
+{
+	FILE *f;
+	char *line;
+	char *end;
+
+	f = fopen (state_file, "r");
+	if (f == NULL)
+	{
+		if (errno != ENOENT)
+		{
+			err (FAILURE, "Cannot open state file %s: %s", state_file,
+				strerror (errno));
+		}
+		watermark = -1;
+		return;
+	}
+	line = (char *) allocate (PATHNAME_LENGTH);
+	if (fgets (line, PATHNAME_LENGTH, f) == NULL)
+	{
+		err (FAILURE, "Cannot read state file %s", state_file);
+	}
+	errno = 0;
+	watermark = strtoll (line, &end, 10);
+	if (errno != 0 || end == line || watermark < 0 ||
+		(*end != '\n' && *end != EOS))
+	{
+		err (FAILURE, "Wrong watermark in state file %s", state_file);
+	}
+	free (line);
+	(void) fclose (f);
+}
+
+/* Save the watermark of the next incremental scan. It is written to a
+   new file renamed over the old one, so a failing run leaves the old
+   watermark. */
+
+static void
+write_watermark (void)
+{
+	FILE *f;
+	char *tmp;
+
+	tmp = (char *) allocate (strlen (state_file) + 8);
+	(void) sprintf (tmp, "%s.new", state_file);
+	f = fopen (tmp, "w");
+	if (f == NULL)
+	{
+		err (FAILURE, "Cannot create state file %s: %s", tmp,
+			strerror (errno));
+	}
+	if (fprintf (f, "%lld\n", next_watermark) < 0 || fflush (f) != 0 ||
+		fsync (fileno (f)) != 0)
+	{
+		err (FAILURE, "Cannot write state file %s: %s", tmp,
+			strerror (errno));
+	}
+	(void) fclose (f);
+	if (rename (tmp, state_file) != 0)
+	{
+		err (FAILURE, "Cannot rename %s to %s: %s", tmp, state_file,
+			strerror (errno));
+	}
+	free (tmp);
+}
+
+/* Write the condition selecting the rows created or modified since the
+   watermark, with the columns prefixed with d. The time stamps are
+   zero padded seconds, so they compare as strings and an index on them
+   can be used. Polling, the objects with an id column larger than the
+   last poll saw are new too. Returns the end of the output. */
+
+static char *
+changed_sql (char *op, char *d, char *id)
+{
+	if (watermark >= 0)
+	{
+		op += sprintf (op, " AND (");
+		if (watch_id >= 0 && id != NULL)
+		{
+			op += sprintf (op, "%s>%lld OR ", id, watch_id);
+		}
+		op += sprintf (op, "%smodify_ts>='%011lld' OR \
+%screate_ts>='%011lld')", d, watermark, d, watermark);
+	}
+	return (op);
+}
+
+/* Build the condition on the collections of the tree since the
+   watermark, an empty string for all. Listing the collections they
+   have to be changed themselves, else they need a changed file, so the
+   collections without one are not scanned at all. */
+
+static char *
+changed_colls_sql (void)
+{
+	char *r;
+	char *op;
+
+	r = (char *) allocate (1024);
+	*r = EOS;
+	if (watermark >= 0)
+	{
+		op = r;
+		op += sprintf (op, " AND EXISTS (SELECT 1 FROM %s WHERE x.coll_id=\
+c.coll_id", dirsonly ? "r_coll_main x" : "r_data_main x");
+		op = changed_sql (op, "x.", dirsonly ? NULL : "x.data_id");
+		op += sprintf (op, ")");
+	}
+	return (r);
+}
+
+/* Write the conditions leaving out the pruned collections and
+   everything below them, on the collection name column. Returns the end
+   of the output. */
+
+static char *
+prune_sql (char *op, char *column)
+{
+	prune_t *p;
+
+	for (p = prunes; p != NULL; p = p->next)
+	{
+		op += sprintf (op, " AND NOT (%s LIKE '", column);
+		op = glob_like (op, p->pattern);
+		op += sprintf (op, "' OR %s LIKE '", column);
+		op = glob_like (op, p->pattern);
+		op += sprintf (op, "/%%')");
+	}
+	return (op);
+}
+
+/* Write the condition for the root collections on the collection
+   name column. Returns the end of the output. */
+
+static char *
+roots_sql (char *op, char *column)
+{
+	int i;
+
+	if (nroots == 1)
+	{
+		op += sprintf (op, "%s='", column);
+		op = sql_literal (op, roots[0].name, false);
+		op += sprintf (op, "'");
+		return (op);
+	}
+	op += sprintf (op, "%s IN (", column);
+	for (i=0; i<nroots; i++)
+	{
+		op += sprintf (op, "%s'", i > 0 ? "," : "");
+		op = sql_literal (op, roots[i].name, false);
+		op += sprintf (op, "'");
+	}
+	op += sprintf (op, ")");
+	return (op);
+}
+
+/* Write the index of the root of the collection name column as a CASE
+   expression. Returns the end of the output. */
+
+static char *
+root_case_sql (char *op, char *column)
+{
+	int i;
+
+	op += sprintf (op, "CASE");
+	for (i=0; i<nroots; i++)
+	{
+		op += sprintf (op, " WHEN %s='", column);
+		op = sql_literal (op, roots[i].name, false);
+		op += sprintf (op, "' OR %s LIKE '", column);
+		op = sql_literal (op, roots[i].name, true);
+		op += sprintf (op, "/%%' THEN %d", i);
+	}
+	op += sprintf (op, " END");
+	return (op);
+}
+
+/* Build the collections of the trees as a subquery with coll_id and
+   coll_name, for the FROM clause.
+
+   The tree is the collection itself and everything below it, found
+   by walking parent_coll_name down from the top. Both lookups are
+   equalities served by the indexes on coll_name and parent_coll_name
+   whatever the collation, so a small tree in a large zone costs only a
+   few index probes. A prefix LIKE would match sibling trees sharing the
+   prefix and cannot use the index unless the collation is C.
+
+   The keyset scan runs the query for every page, so it uses a prefix
+   match on the name instead of walking the tree again each time.
+
+   A parallel scan process sees only its partition of the collections,
+   the ids modulo the number of partitions.
+
+   With several roots all the trees are walked in the same query, the
+   roots do not overlap. */
+
+static char *
+colls_sql (void)
+{
+	char *r;
+	char *op;
+	int i;
+
+	r = (char *) allocate (roots_size + prunes_size + 1024);
+	op = r;
+	if (! keyset)
+	{
+
+		/* The root has itself as parent, stop there. A pruned
+		   collection is not walked into, so nothing below it is read. */
+		op += sprintf (op, "(WITH RECURSIVE t(coll_id,coll_name) AS \
+(SELECT coll_id,coll_name FROM r_coll_main WHERE ");
+		op = roots_sql (op, "coll_name");
+		op = prune_sql (op, "coll_name");
+		op += sprintf (op, " UNION ALL \
+SELECT m.coll_id,m.coll_name FROM r_coll_main m JOIN t \
+ON m.parent_coll_name=t.coll_name WHERE m.coll_name<>t.coll_name");
+		op = prune_sql (op, "m.coll_name");
+		op += sprintf (op, ") SELECT coll_id,coll_name FROM t");
+		if (part >= 0)
+		{
+			op += sprintf (op, " WHERE coll_id %% %d = %d", nparts, part);
+		}
+		op += sprintf (op, ")");
+	}
+	else
+	{
+
+		/* The roots or names starting with a root and a slash. */
+		op += sprintf (op, "(SELECT coll_id,coll_name FROM r_coll_main \
+WHERE (");
+		op = roots_sql (op, "coll_name");
+		for (i=0; i<nroots; i++)
+		{
+			op += sprintf (op, " OR coll_name LIKE '");
+			op = sql_literal (op, roots[i].name, true);
+			op += sprintf (op, "/%%'");
+		}
+		op += sprintf (op, ")");
+		op = prune_sql (op, "coll_name");
+		op += sprintf (op, ")");
+	}
 	return (r);
 }
 
-/* Cleaning up. Refers global variable db. */
+/* Add a pruned collection pattern, a trailing slash is dropped. */
+
+static void
+add_prune (char *pattern)
+{
+	prune_t *p;
+	prune_t **tail;
+	size_t n;
+
+	n = strlen (pattern);
+	while (n > 1 && pattern[n - 1] == SLASH)
+	{
+		n--;
+	}
+	if (n == 0)
+	{
+		err (FAILURE, "Empty prune pattern");
+	}
+	p = new (prune_t);
+	p->pattern = (char *) allocate (n + 1);
+	memcpy (p->pattern, pattern, n);
+	p->pattern[n] = EOS;
+	p->next = NULL;
+	tail = &prunes;
+	while (*tail != NULL)
+	{
+		tail = &(*tail)->next;
+	}
+	*tail = p;
+
+	/* Two escaped copies of the pattern and the column names. */
+	prunes_size += 4 * n + 128;
+}
+
+/* Add the items of a file with the add function, one per line,
+   skipping empty lines and lines starting with #. What the items are is
+   for the error messages. */
+
+static void
+read_list (char *file, char *what, void (*add) (char *))
+{
+	FILE *f;
+	char *line;
+	size_t n;
+
+	f = fopen (file, "r");
+	if (f == NULL)
+	{
+		err (FAILURE, "Cannot open %s file %s: %s", what, file,
+			strerror (errno));
+	}
+	line = (char *) allocate (PATHNAME_LENGTH);
+	while (fgets (line, PATHNAME_LENGTH, f) != NULL)
+	{
+		n = strlen (line);
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+		{
+			line[--n] = EOS;
+		}
+		if (n > 0 && line[0] != '#')
+		{
+			add (line);
+		}
+	}
+	if (ferror (f))
+	{
+		err (FAILURE, "Cannot read %s file %s: %s", what, file,
+			strerror (errno));
+	}
+	fclose (f);
+	free (line);
+}
+
+/* Add a root collection, an absolute name without trailing slash. */
+
+static void
+add_root (char *name)
+{
+	root_t *r;
+	size_t n;
+
+	n = strlen (name);
+	if (n == 0)
+	{
+		err (FAILURE, "Directory string empty - confused");
+	}
+	if (name[n - 1] == SLASH)
+	{
+		err (FAILURE, "Directory name should not have trailing slash");
+	}
+	if (name[0] != SLASH)
+	{
+		err (FAILURE, "Directory name should be an absolute pathname");
+	}
+	roots = (root_t *) realloc (roots, (nroots + 1) * sizeof (root_t));
+	if (roots == NULL)
+	{
+		err (FAILURE, "Cannot allocate %d roots", nroots + 1);
+	}
+	r = roots + nroots++;
+	r->key = (char *) allocate (n + 2);
+	memcpy (r->key, name, n);
+	r->key[n] = SLASH;
+	r->key[n + 1] = EOS;
+	r->key_len = n + 1;
+	r->name = (char *) allocate (n + 1);
+	memcpy (r->name, name, n + 1);
+	r->fno = (long long unsigned) 0;
+	r->total = (long long unsigned) 0;
+
+	/* The name as literal and LIKE pattern, escapes doubling it. */
+	roots_size += 4 * n + 128;
+}
+
+/* Compare roots by key for qsort. */
+
+static int
+compare_root (const void *a, const void *b)
+{
+	return (strcmp (((const root_t *) a)->key, ((const root_t *) b)->key));
+}
+
+/* Sort the roots and drop those in the tree of another, they would be
+   seen twice. A root below another sorts right after it or after other
+   roots below it, which are dropped too. */
+
+static void
+sort_roots (void)
+{
+	int i;
+	int n;
+
+	qsort (roots, (size_t) nroots, sizeof (root_t), &compare_root);
+	n = 0;
+	for (i=0; i<nroots; i++)
+	{
+		if (n > 0 && strncmp (roots[i].key, roots[n - 1].key,
+			roots[n - 1].key_len) == 0)
+		{
+			if (debug > 5)
+			{
+				msg ("Root %s is in the tree of %s", roots[i].name,
+					roots[n - 1].name);
+			}
+			free (roots[i].key);
+			free (roots[i].name);
+		}
+		else
+		{
+			roots[n++] = roots[i];
+		}
+	}
+	nroots = n;
+}
+
+/* Find the root of a directory given as its name and a slash, of length
+   n. The keys sort like the trees, so the root is the last key not after
+   the directory. Returns NULL if none. */
+
+static root_t *
+find_root (char *dir, size_t n)
+{
+	int low;
+	int high;
+	int mid;
+	int cmp;
+	root_t *r;
+
+	low = 0;
+	high = nroots - 1;
+	r = NULL;
+	while (low <= high)
+	{
+		mid = (low + high) / 2;
+		cmp = strncmp (roots[mid].key, dir, n);
+		if (cmp < 0 || (cmp == 0 && roots[mid].key_len <= n))
+		{
+			r = roots + mid;
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	if (r != NULL && (r->key_len > n || memcmp (r->key, dir, r->key_len) != 0))
+	{
+		r = NULL;
+	}
+	return (r);
+}
+
+/* Parse a metadata condition attr[op value[;unit]]. */
+
+static avu_t *
+parse_avu (char *s)
+{
+	avu_t *r;
+	char *p;
+	size_t n;
+
+	r = new (avu_t);
+	r->next = NULL;
+	r->value = NULL;
+	r->unit = NULL;
+	r->op = "=";
+	n = strcspn (s, "=!<>");
+	if (n == 0)
+	{
+		err (FAILURE, "No attribute name in '%s'", s);
+	}
+	r->attr = (char *) allocate (n + 1);
+	memcpy (r->attr, s, n);
+	r->attr[n] = EOS;
+	p = s + n;
+	if (*p == EOS)
+	{
+
+		/* Only the attribute, any value. */
+		return (r);
+	}
+	if (strncmp (p, "!=", 2) == 0 || strncmp (p, "<=", 2) == 0 ||
+		strncmp (p, ">=", 2) == 0)
+	{
+		r->op = *p == '!' ? "!=" : (*p == '<' ? "<=" : ">=");
+		p += 2;
+	}
+	else if (*p == '=' || *p == '<' || *p == '>')
+	{
+		r->op = *p == '=' ? "=" : (*p == '<' ? "<" : ">");
+		p++;
+	}
+	else
+	{
+		err (FAILURE, "Wrong comparison in '%s'", s);
+	}
+	r->value = strdup (p);
+	if (r->value == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+	p = strchr (r->value, ';');
+	if (p != NULL)
+	{
+		*p = EOS;
+		r->unit = p + 1;
+	}
+	if (*r->op == '<' || *r->op == '>')
+	{
+		(void) strtod (r->value, &p);
+		if (p == r->value || *p != EOS)
+		{
+			err (FAILURE, "Not a number to compare in '%s'", s);
+		}
+	}
+	return (r);
+}
+
+/* Build the metadata conditions on the object id, empty if none. Every
+   condition is an EXISTS over the object metadata map, which the
+   database answers from the index on the object id. Comparing with
+   < or > is numeric, on the values which are numbers. */
+
+static char *
+avu_filter_sql (char *id)
+{
+	char *r;
+	char *op;
+	avu_t *a;
+	size_t n;
+	size_t l;
+
+	n = 16;
+	for (a = avus; a != NULL; a = a->next)
+	{
+		n += strlen (id) + 1024 + 2 * strlen (a->attr);
+		n += a->value != NULL ? 4 * strlen (a->value) : 0;
+		n += a->unit != NULL ? 2 * strlen (a->unit) : 0;
+	}
+	r = (char *) allocate (n);
+	op = r;
+	*op = EOS;
+	for (a = avus; a != NULL; a = a->next)
+	{
+		op += sprintf (op, " AND EXISTS (SELECT 1 FROM r_objt_metamap om \
+JOIN r_meta_main mm ON mm.meta_id=om.meta_id WHERE om.object_id=%s \
+AND mm.meta_attr_name='", id);
+		op = sql_literal (op, a->attr, false);
+		op += sprintf (op, "'");
+		if (a->value != NULL)
+		{
+			l = strlen (a->value);
+			if (strcmp (a->op, "=") == 0 && l > 0 && a->value[l - 1] == '*')
+			{
+
+				/* Prefix. */
+				a->value[l - 1] = EOS;
+				op += sprintf (op, " AND mm.meta_attr_value LIKE '");
+				op = sql_literal (op, a->value, true);
+				op += sprintf (op, "%%'");
+				a->value[l - 1] = '*';
+			}
+			else if (*a->op == '<' || *a->op == '>')
+			{
+
+				/* Numbers only, others do not compare. */
+				op += sprintf (op, " AND CASE WHEN mm.meta_attr_value \
+~ '^ *[-+]?([0-9]+[.]?[0-9]*|[.][0-9]+)([eE][-+]?[0-9]+)? *$' \
+THEN mm.meta_attr_value::numeric END %s '", a->op);
+				op = sql_literal (op, a->value, false);
+				op += sprintf (op, "'::numeric");
+			}
+			else
+			{
+				op += sprintf (op, " AND mm.meta_attr_value %s '", a->op);
+				op = sql_literal (op, a->value, false);
+				op += sprintf (op, "'");
+			}
+		}
+		if (a->unit != NULL)
+		{
+			op += sprintf (op, " AND mm.meta_attr_unit='");
+			op = sql_literal (op, a->unit, false);
+			op += sprintf (op, "'");
+		}
+		op += sprintf (op, ")");
+	}
+	return (r);
+}
+
+/* Can the database match the regexp the same way. Postgres regular
+   expressions take the POSIX extended ones, except for backslash
+   escapes: a backslash and a letter is a class or the like, and in
+   brackets the backslash escapes too. Only escaped punctuation outside
+   brackets is taken. The program matches bytes and a UTF-8 database
+   characters, so neither what matches any character, a dot, a negated
+   bracket or a class, nor bounds or bytes which are not ASCII, where
+   the counts could differ. */
+
+static int
+regexp_translatable (char *re)
+{
+	char *p;
+	int brackets;
+
+	brackets = false;
+	for (p = re; *p != EOS; p++)
+	{
+		if ((unsigned char) *p > 127)
+		{
+			return (false);
+		}
+		if (brackets)
+		{
+
+			/* A class, collating element or equivalence class. */
+			if (*p == '[' && p[1] != EOS && strchr (":.=", p[1]) != NULL)
+			{
+				return (false);
+			}
+			if (*p == ']')
+			{
+				brackets = false;
+			}
+		}
+		else if (*p == '\\')
+		{
+			if (p[1] == EOS || strchr (".[]()*+?{}|^$\\/", p[1]) == NULL ||
+				strchr (re, '[') != NULL)
+			{
+				return (false);
+			}
+			p++;
+		}
+		else if (*p == '.' || *p == '{')
+		{
+			return (false);
+		}
+		else if (*p == '[')
+		{
+			if (p[1] == '^')
+			{
+				return (false);
+			}
+
+			/* A closing bracket first is taken literally. */
+			if (p[1] == ']')
+			{
+				p++;
+			}
+			brackets = true;
+		}
+	}
+	return (true);
+}
+
+/* Build the conditions on the path expression for the -X regexp and
+   the -l length which the database evaluates, empty if none. */
+
+static char *
+path_filter_sql (char *path)
+{
+	char *r;
+	char *op;
+
+	r = (char *) allocate (2 * strlen (path) +
+		(regexp != NULL ? 2 * strlen (regexp) : 0) + 1024);
+	op = r;
+	*op = EOS;
+	if (pushdown_regexp)
+	{
+		op += sprintf (op, " AND (%s) ~ '", path);
+		op = sql_literal (op, regexp, false);
+		op += sprintf (op, "'");
+	}
+	if (pushdown_length)
+	{
+		op += sprintf (op, " AND octet_length(%s) > %d", path, check_length);
+	}
+	return (r);
+}
+
+/* Expression node kinds, the operators and the primaries. */
+#define EXPR_AND ((int) 0)
+#define EXPR_OR ((int) 1)
+#define EXPR_NOT ((int) 2)
+#define EXPR_SIZE ((int) 3)
+#define EXPR_NAME ((int) 4)
+#define EXPR_PATH ((int) 5)
+#define EXPR_MINDEPTH ((int) 6)
+#define EXPR_MAXDEPTH ((int) 7)
+#define EXPR_MTIME ((int) 8)
+#define EXPR_CTIME ((int) 9)
+#define EXPR_OWNER ((int) 10)
+#define EXPR_STATUS ((int) 11)
+#define EXPR_RESC ((int) 12)
+
+/* Maximum number of tokens in an expression. */
+#define EXPR_TOKENS ((int) 256)
+
+/* Expression node. */
+typedef struct expr {
+
+	/* Kind of node. */
+	int kind;
+
+	/* Comparison for numbers, -1 less, 0 equal, 1 greater. */
+	int cmp;
+
+	/* Number compared to, the lower and upper bound for equal times. */
+	long long value;
+	long long upper;
+
+	/* Name or pattern. */
+	char *text;
+
+	/* Evaluated by ifind, not by the database. */
+	int client;
+
+	/* Operands. */
+	struct expr *left;
+	struct expr *right;
+} expr_t;
+
+/* Parser state, the tokens and the next one. */
+static char *expr_tokens[EXPR_TOKENS];
+static int expr_ntokens = 0;
+static int expr_next = 0;
+
+/* Parts of the expression for the database and for ifind. */
+static expr_t *expr_where = NULL;
+static expr_t *expr_client = NULL;
+
+/* Number of slashes in the root collection name. */
+static int root_slashes = 0;
+
+/* Split the expression into tokens at white space, quotes group. */
+
+static void
+expr_tokenize (char *s)
+{
+	char *ip;
+	char *op;
+	char quote;
+
+	ip = s;
+	while (*ip != EOS)
+	{
+		while (isspace ((unsigned char) *ip))
+		{
+			ip++;
+		}
+		if (*ip == EOS)
+		{
+			break;
+		}
+		if (expr_ntokens >= EXPR_TOKENS)
+		{
+			err (FAILURE, "Expression has more than %d tokens", EXPR_TOKENS);
+		}
+		op = (char *) allocate (strlen (ip) + 1);
+		expr_tokens[expr_ntokens++] = op;
+		while (*ip != EOS && ! isspace ((unsigned char) *ip))
+		{
+			if (*ip == '\'' || *ip == '"')
+			{
+				quote = *ip++;
+				while (*ip != EOS && *ip != quote)
+				{
+					*op++ = *ip++;
+				}
+				if (*ip != quote)
+				{
+					err (FAILURE, "Unterminated quote in expression");
+				}
+				ip++;
+			}
+			else
+			{
+				*op++ = *ip++;
+			}
+		}
+		*op = EOS;
+	}
+}
+
+/* Create expression node. */
+
+static expr_t *
+expr_node (int kind, expr_t *left, expr_t *right)
+{
+	expr_t *r;
+
+	r = new (expr_t);
+	r->kind = kind;
+	r->cmp = 0;
+	r->value = 0;
+	r->upper = 0;
+	r->text = NULL;
+	r->client = false;
+	r->left = left;
+	r->right = right;
+	return (r);
+}
+
+/* Next token, NULL at the end. */
+
+static char *
+expr_peek (void)
+{
+	return (expr_next < expr_ntokens ? expr_tokens[expr_next] : NULL);
+}
+
+/* Argument of a primary. */
+
+static char *
+expr_argument (char *primary)
+{
+	if (expr_next >= expr_ntokens)
+	{
+		err (FAILURE, "Missing argument for %s in expression", primary);
+	}
+	return (expr_tokens[expr_next++]);
+}
+
+/* Number with an optional + or - for greater or less. */
+
+static long long
+expr_number (expr_t *e, char *primary, char *arg, char **end)
+{
+	long long r;
+
+	e->cmp = 0;
+	if (*arg == '+')
+	{
+		e->cmp = 1;
+		arg++;
+	}
+	else if (*arg == '-')
+	{
+		e->cmp = -1;
+		arg++;
+	}
+	if (! isdigit ((unsigned char) *arg))
+	{
+		err (FAILURE, "Wrong number '%s' for %s in expression", arg, primary);
+	}
+	r = strtoll (arg, end, 10);
+	return (r);
+}
+
+/* Seconds since the epoch of a local date, YYYY-MM-DD[ HH:MM[:SS]]. */
+
+static long long
+expr_date (char *arg)
+{
+	struct tm tm;
+	int n;
+	time_t t;
+
+	memset (&tm, 0, sizeof (tm));
+	n = sscanf (arg, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n < 3)
+	{
+		err (FAILURE, "Wrong date '%s' in expression", arg);
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	t = mktime (&tm);
+	if (t == (time_t) -1)
+	{
+		err (FAILURE, "Wrong date '%s' in expression", arg);
+	}
+	return ((long long) t);
+}
+
+/* Time in days ago like find -mtime: more than n days, less than n
+   days, or n days ago rounded down. */
+
+static void
+expr_days (expr_t *e, char *primary, char *arg)
+{
+	long long n;
+	long long now;
+	char *end;
+
+	n = expr_number (e, primary, arg, &end);
+	if (*end != EOS)
+	{
+		err (FAILURE, "Wrong number of days '%s' in expression", arg);
+	}
+	now = (long long) time (NULL);
+	if (e->cmp > 0)
+	{
+
+		/* Older than n + 1 days. */
+		e->cmp = -1;
+		e->value = now - (n + 1) * 86400;
+	}
+	else if (e->cmp < 0)
+	{
+
+		/* Newer than n days. */
+		e->cmp = 1;
+		e->value = now - n * 86400;
+	}
+	else
+	{
+		e->value = now - (n + 1) * 86400;
+		e->upper = now - n * 86400;
+	}
+}
+
+static expr_t *expr_or (void);
+
+/* Parse a primary or a parenthesized expression. */
+
+static expr_t *
+expr_primary (void)
+{
+	char *t;
+	char *arg;
+	char *end;
+	expr_t *e;
+
+	t = expr_peek ();
+	if (t == NULL)
+	{
+		err (FAILURE, "Expression ends too early");
+	}
+	expr_next++;
+	if (strcmp (t, "(") == 0)
+	{
+		e = expr_or ();
+		t = expr_peek ();
+		if (t == NULL || strcmp (t, ")") != 0)
+		{
+			err (FAILURE, "Missing ) in expression");
+		}
+		expr_next++;
+		return (e);
+	}
+	if (strcmp (t, "!") == 0 || strcmp (t, "-not") == 0)
+	{
+		return (expr_node (EXPR_NOT, expr_primary (), NULL));
+	}
+	e = expr_node (EXPR_AND, NULL, NULL);
+	if (strcmp (t, "-size") == 0)
+	{
+
+		/* Bytes with an optional unit. */
+		e->kind = EXPR_SIZE;
+		arg = expr_argument (t);
+		e->value = expr_number (e, t, arg, &end);
+		switch (*end)
+		{
+		case EOS:
+		case 'c':
+			break;
+		case 'k':
+			e->value <<= 10;
+			break;
+		case 'M':
+			e->value <<= 20;
+			break;
+		case 'G':
+			e->value <<= 30;
+			break;
+		case 'T':
+			e->value <<= 40;
+			break;
+		default:
+			err (FAILURE, "Wrong size unit in '%s' in expression", arg);
+			break;
+		}
+		if (*end != EOS && end[1] != EOS)
+		{
+			err (FAILURE, "Wrong size '%s' in expression", arg);
+		}
+	}
+	else if (strcmp (t, "-name") == 0 || strcmp (t, "-path") == 0)
+	{
+
+		/* Globs with brackets have classes, ranges and negation, ifind
+		   matches those with fnmatch. */
+		e->kind = strcmp (t, "-name") == 0 ? EXPR_NAME : EXPR_PATH;
+		e->text = expr_argument (t);
+		e->client = strchr (e->text, '[') != NULL;
+	}
+	else if (strcmp (t, "-mindepth") == 0 || strcmp (t, "-maxdepth") == 0)
+	{
+		e->kind = strcmp (t, "-mindepth") == 0 ? EXPR_MINDEPTH : EXPR_MAXDEPTH;
+		arg = expr_argument (t);
+		e->value = expr_number (e, t, arg, &end);
+		if (e->cmp != 0 || *end != EOS)
+		{
+			err (FAILURE, "Wrong depth '%s' in expression", arg);
+		}
+	}
+	else if (strcmp (t, "-mtime") == 0 || strcmp (t, "-ctime") == 0)
+	{
+		e->kind = strcmp (t, "-mtime") == 0 ? EXPR_MTIME : EXPR_CTIME;
+		expr_days (e, t, expr_argument (t));
+	}
+	else if (strcmp (t, "-newermt") == 0 || strcmp (t, "-newerct") == 0)
+	{
+		e->kind = strcmp (t, "-newermt") == 0 ? EXPR_MTIME : EXPR_CTIME;
+		e->cmp = 1;
+		e->value = expr_date (expr_argument (t));
+	}
+	else if (strcmp (t, "-owner") == 0)
+	{
+		e->kind = EXPR_OWNER;
+		e->text = expr_argument (t);
+	}
+	else if (strcmp (t, "-resc") == 0)
+	{
+		e->kind = EXPR_RESC;
+		e->text = expr_argument (t);
+	}
+	else if (strcmp (t, "-status") == 0)
+	{
+
+		/* Replica status, data_is_dirty. */
+		e->kind = EXPR_STATUS;
+		arg = expr_argument (t);
+		e->value = expr_number (e, t, arg, &end);
+		if (e->cmp != 0 || *end != EOS)
+		{
+			err (FAILURE, "Wrong status '%s' in expression", arg);
+		}
+	}
+	else
+	{
+		err (FAILURE, "Unknown '%s' in expression", t);
+	}
+	return (e);
+}
+
+/* Parse primaries joined with -a, -and or nothing. */
+
+static expr_t *
+expr_and (void)
+{
+	expr_t *e;
+	char *t;
+
+	e = expr_primary ();
+	t = expr_peek ();
+	while (t != NULL && strcmp (t, ")") != 0 && strcmp (t, "-o") != 0 &&
+		strcmp (t, "-or") != 0)
+	{
+		if (strcmp (t, "-a") == 0 || strcmp (t, "-and") == 0)
+		{
+			expr_next++;
+		}
+		e = expr_node (EXPR_AND, e, expr_primary ());
+		t = expr_peek ();
+	}
+	return (e);
+}
+
+/* Parse terms joined with -o or -or. */
+
+static expr_t *
+expr_or (void)
+{
+	expr_t *e;
+	char *t;
+
+	e = expr_and ();
+	t = expr_peek ();
+	while (t != NULL && (strcmp (t, "-o") == 0 || strcmp (t, "-or") == 0))
+	{
+		expr_next++;
+		e = expr_node (EXPR_OR, e, expr_and ());
+		t = expr_peek ();
+	}
+	return (e);
+}
+
+/* Has the expression a part ifind has to evaluate. */
+
+static int
+expr_has_client (expr_t *e)
+{
+	if (e == NULL)
+	{
+		return (false);
+	}
+	return (e->client || expr_has_client (e->left) ||
+		expr_has_client (e->right));
+}
+
+/* Can ifind evaluate the expression with the columns it has. */
+
+static int
+expr_client_ok (expr_t *e)
+{
+	if (e == NULL)
+	{
+		return (true);
+	}
+	switch (e->kind)
+	{
+	case EXPR_AND:
+	case EXPR_OR:
+	case EXPR_NOT:
+		return (expr_client_ok (e->left) && expr_client_ok (e->right));
+	case EXPR_SIZE:
+	case EXPR_NAME:
+	case EXPR_PATH:
+	case EXPR_MINDEPTH:
+	case EXPR_MAXDEPTH:
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+/* Does the expression compare the size, which may differ between the
+   replicas of an object. */
+
+static int
+expr_has_size (expr_t *e)
+{
+	if (e == NULL)
+	{
+		return (false);
+	}
+	return (e->kind == EXPR_SIZE || expr_has_size (e->left) ||
+		expr_has_size (e->right));
+}
+
+/* Sort the conjuncts at the top into those for the database and those
+   for ifind. */
+
+static void
+expr_split (expr_t *e)
+{
+	if (e->kind == EXPR_AND && e->left != NULL)
+	{
+		expr_split (e->left);
+		expr_split (e->right);
+	}
+	else if (! expr_has_client (e))
+	{
+		expr_where = expr_where == NULL ? e :
+			expr_node (EXPR_AND, expr_where, e);
+	}
+	else if (expr_client_ok (e))
+	{
+		expr_client = expr_client == NULL ? e :
+			expr_node (EXPR_AND, expr_client, e);
+	}
+	else
+	{
+		err (FAILURE, "Patterns with brackets go with -size, -name, -path \
+and the depths only, unless joined with -a");
+	}
+}
+
+/* Count the slashes of the first root, the depths are from there. The
+   roots must all be at the same depth when a depth is asked, what is
+   asked is for the root and the error is for what. */
+
+static void
+count_root_slashes (int asked, char *what)
+{
+	char *p;
+	int i;
+	int n;
+
+	root_slashes = -1;
+	for (i=0; i<nroots; i++)
+	{
+		n = 0;
+		for (p = roots[i].name; *p != EOS; p++)
+		{
+			if (*p == SLASH)
+			{
+				n++;
+			}
+		}
+		if (root_slashes >= 0 && n != root_slashes && asked)
+		{
+			err (FAILURE, "The roots are not at the same depth for %s", what);
+		}
+		root_slashes = n;
+	}
+}
+
+/* Compile the expression for the root collections. */
+
+static void
+expr_compile (char *s)
+{
+	int i;
+	int depths;
+
+	expr_tokenize (s);
+	if (expr_ntokens == 0)
+	{
+		err (FAILURE, "Empty expression");
+	}
+	expr_next = 0;
+	expr_split (expr_or ());
+	if (expr_next != expr_ntokens)
+	{
+		err (FAILURE, "Unexpected '%s' in expression", expr_tokens[expr_next]);
+	}
+	depths = false;
+	for (i=0; i<expr_ntokens; i++)
+	{
+		if (strcmp (expr_tokens[i], "-mindepth") == 0 ||
+			strcmp (expr_tokens[i], "-maxdepth") == 0)
+		{
+			depths = true;
+		}
+	}
+	count_root_slashes (depths, "-mindepth and -maxdepth");
+}
+
+/* Comparison operator. */
+
+static char *
+expr_op (int cmp)
+{
+	return (cmp < 0 ? "<" : (cmp > 0 ? ">" : "="));
+}
+
+/* Write the SQL for the expression, with the data columns prefixed
+   with d and the collection name expression coll. */
+
+static char *
+expr_sql (char *op, expr_t *e, char *d, char *coll)
+{
+	char *column;
+
+	switch (e->kind)
+	{
+	case EXPR_AND:
+	case EXPR_OR:
+		op += sprintf (op, "(");
+		op = expr_sql (op, e->left, d, coll);
+		op += sprintf (op, e->kind == EXPR_AND ? " AND " : " OR ");
+		op = expr_sql (op, e->right, d, coll);
+		op += sprintf (op, ")");
+		break;
+	case EXPR_NOT:
+		op += sprintf (op, "NOT (");
+		op = expr_sql (op, e->left, d, coll);
+		op += sprintf (op, ")");
+		break;
+	case EXPR_SIZE:
+		op += sprintf (op, "%sdata_size %s %lld", d, expr_op (e->cmp),
+			e->value);
+		break;
+	case EXPR_NAME:
+		op += sprintf (op, "%sdata_name LIKE '", d);
+		op = glob_like (op, e->text);
+		op += sprintf (op, "'");
+		break;
+	case EXPR_PATH:
+		op += sprintf (op, "(%s||'/'||%sdata_name) LIKE '", coll, d);
+		op = glob_like (op, e->text);
+		op += sprintf (op, "'");
+		break;
+	case EXPR_MINDEPTH:
+	case EXPR_MAXDEPTH:
+
+		/* A file in the root is at depth 1. */
+		op += sprintf (op, "length(%s)-length(replace(%s,'/','')) %s %lld",
+			coll, coll, e->kind == EXPR_MINDEPTH ? ">=" : "<=",
+			e->value + root_slashes - 1);
+		break;
+	case EXPR_MTIME:
+	case EXPR_CTIME:
+		column = e->kind == EXPR_MTIME ? "modify_ts" : "create_ts";
+		if (e->cmp == 0)
+		{
+			op += sprintf (op, "(%s%s::bigint BETWEEN %lld AND %lld)", d,
+				column, e->value, e->upper);
+		}
+		else
+		{
+			op += sprintf (op, "%s%s::bigint %s %lld", d, column,
+				expr_op (e->cmp), e->value);
+		}
+		break;
+	case EXPR_OWNER:
+	case EXPR_RESC:
+		op += sprintf (op, "%s%s = '", d,
+			e->kind == EXPR_OWNER ? "data_owner_name" : "resc_name");
+		op = sql_literal (op, e->text, false);
+		op += sprintf (op, "'");
+		break;
+	case EXPR_STATUS:
+		op += sprintf (op, "%sdata_is_dirty = %lld", d, e->value);
+		break;
+	default:
+		err (FAILURE, "Wrong expression kind %d - confused", e->kind);
+		break;
+	}
+	return (op);
+}
+
+/* Number of nodes in the expression. */
+
+static int
+expr_count (expr_t *e)
+{
+	if (e == NULL)
+	{
+		return (0);
+	}
+	return (1 + expr_count (e->left) + expr_count (e->right));
+}
+
+/* Build the condition for the database part of the expression, empty
+   if none. */
+
+static char *
+expr_filter_sql (char *d, char *coll)
+{
+	char *r;
+	char *op;
+
+	r = (char *) allocate ((size_t) expr_count (expr_where) *
+		(2 * strlen (coll) + 256) +
+		(expression != NULL ? 4 * strlen (expression) : 0) + 16);
+	op = r;
+	*op = EOS;
+	if (expr_where != NULL)
+	{
+		op += sprintf (op, " AND ");
+		op = expr_sql (op, expr_where, d, coll);
+	}
+	return (r);
+}
+
+/* Evaluate the ifind part of the expression for a file. */
+
+static int
+expr_eval (expr_t *e, long long unsigned size, char *name, char *path,
+	int depth)
+{
+	long long v;
+	int cmp;
+
+	switch (e->kind)
+	{
+	case EXPR_AND:
+		return (expr_eval (e->left, size, name, path, depth) &&
+			expr_eval (e->right, size, name, path, depth));
+	case EXPR_OR:
+		return (expr_eval (e->left, size, name, path, depth) ||
+			expr_eval (e->right, size, name, path, depth));
+	case EXPR_NOT:
+		return (! expr_eval (e->left, size, name, path, depth));
+	case EXPR_SIZE:
+		v = (long long) size;
+		cmp = v < e->value ? -1 : (v > e->value ? 1 : 0);
+		return (cmp == e->cmp);
+	case EXPR_NAME:
+		return (fnmatch (e->text, name, 0) == 0);
+	case EXPR_PATH:
+		return (fnmatch (e->text, path, 0) == 0);
+	case EXPR_MINDEPTH:
+		return (depth >= e->value);
+	case EXPR_MAXDEPTH:
+		return (depth <= e->value);
+	default:
+		err (FAILURE, "Wrong expression kind %d - confused", e->kind);
+		break;
+	}
+	return (false);
+}
+
+/* Print the plan of the statement, for debugging. */
+
+static void
+explain (PGconn *conn, char *select, int nparams, char **values)
+{
+	char *explain_select;
+	char *explain_cmd;
+	PGresult *res;
+	int i;
+
+	explain_select = "EXPLAIN %s";
+	explain_cmd = (char *) allocate (strlen (explain_select) +
+		strlen (select) + 1);
+	(void) sprintf (explain_cmd, explain_select, select);
+	res = PQexecParams (conn, explain_cmd, nparams, NULL,
+		(const char * const *) values, NULL, NULL, 0);
+	if (PQresultStatus (res) != PGRES_TUPLES_OK)
+	{
+		perr (PGRESEXEC, conn, "Error %s executing '%s'",
+			PQresStatus (PQresultStatus (res)), explain_cmd);
+	}
+	for (i=0; i<PQntuples (res); i++)
+	{
+		msg ("    %s", PQgetvalue (res, i, 0));
+	}
+	PQclear (res);
+	free (explain_cmd);
+}
+
+/* Capture the plan of the statement with the times and buffers into the
+   plan file if there is one. The statement is run for it, so only the
+   scan queries are captured, which read. */
+
+static void
+capture_plan (PGconn *conn, char *select, int nparams, char **values)
+{
+	char *explain_select;
+	char *explain_cmd;
+	PGresult *res;
+	int i;
+	double t;
+	size_t n;
+	char *plan;
+	char *op;
+
+	if (plan_fd < 0)
+	{
+		return;
+	}
+	explain_select = "EXPLAIN (ANALYZE, BUFFERS) %s";
+	explain_cmd = (char *) allocate (strlen (explain_select) +
+		strlen (select) + 1);
+	(void) sprintf (explain_cmd, explain_select, select);
+	t = clock_seconds ();
+	res = PQexecParams (conn, explain_cmd, nparams, NULL,
+		(const char * const *) values, NULL, NULL, 0);
+	t = clock_seconds () - t;
+	if (PQresultStatus (res) != PGRES_TUPLES_OK)
+	{
+		perr (PGRESEXEC, conn, "Error %s executing '%s'",
+			PQresStatus (PQresultStatus (res)), explain_cmd);
+	}
+
+	/* One appending write per plan, so the plans of the scan processes
+	   do not mix. */
+	n = strlen (select) + 1024;
+	for (i=0; i<nparams; i++)
+	{
+		n += strlen (values[i]) + 32;
+	}
+	for (i=0; i<PQntuples (res); i++)
+	{
+		n += (size_t) PQgetlength (res, i, 0) + 1;
+	}
+	plan = (char *) allocate (n);
+	op = plan;
+	op += sprintf (op, "-- %s\n", select);
+	for (i=0; i<nparams; i++)
+	{
+		op += sprintf (op, "-- $%d = %s\n", i + 1, values[i]);
+	}
+	for (i=0; i<PQntuples (res); i++)
+	{
+		op += sprintf (op, "%s\n", PQgetvalue (res, i, 0));
+	}
+	op += sprintf (op, "-- %.3f ms with EXPLAIN\n\n", t * 1000.0);
+	if (write (plan_fd, plan, (size_t) (op - plan)) != (ssize_t) (op - plan))
+	{
+		err (FAILURE, "Cannot write plan: %s", strerror (errno));
+	}
+	free (plan);
+	PQclear (res);
+	free (explain_cmd);
+}
+
+/* Build select statement for directories. */
+
+static char *
+directories_sql (int sorted)
+{
+
+	/* Collections of the tree. */
+	char *colls;
+
+	/* Collections select statement sprintf string. */
+	char *colls_select;
+
+	/* Collections select statement created. */
+	char *colls_cmd;
+
+	/* Conditions on the names and metadata, only when listing the
+	   directories. */
+	char *filter;
+	char *meta;
+
+	/* Condition on the changes since the watermark. */
+	char *changed;
+
+	/* Build sprintf string to create select statement. */
+	colls = colls_sql ();
+	colls_select = "SELECT c.coll_id,c.coll_name%s FROM %s c WHERE TRUE%s%s%s";
+	filter = dirsonly ? path_filter_sql ("c.coll_name") : strdup ("");
+	meta = dirsonly ? avu_filter_sql ("c.coll_id") : strdup ("");
+	if (filter == NULL || meta == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+
+	changed = changed_colls_sql ();
+
+	/* Create sprintf target, should be long enough. */
+	colls_cmd = (char *) allocate (strlen (colls_select) + strlen (colls) +
+		strlen (filter) + strlen (meta) + strlen (changed) + 1024);
+
+	/* Create SQL statement. */
+	(void) sprintf (colls_cmd, colls_select, dirsonly && watch_seconds > 0 ?
+		CHANGED_COLL : "", colls, filter, meta, changed);
+	free (colls);
+	free (filter);
+	free (meta);
+	free (changed);
+
+	/* Add sort clause if specified. */
+	if (sorted == 0)
+	{
+		;
+	}
+	else if (sorted == 1)
+	{
+		strcat (colls_cmd,  " ORDER BY c.coll_name ASC");
+	}
+	else if (sorted == 2)
+	{
+		strcat (colls_cmd,  " ORDER BY c.coll_name DESC");
+	}
+	else if (sorted == 3)
+	{
+
+		/* Directories are always unique. */
+		strcat (colls_cmd,  " ORDER BY c.coll_name ASC");
+	}
+	else if (sorted == 4)
+	{
+
+		/* Directories are always unique. */
+		strcat (colls_cmd,  " ORDER BY c.coll_name DESC");
+	}
+	else
+	{
+		err (FAILURE, "Wrong sort option %d", sorted);
+	}
+	return (colls_cmd);
+}
+
+/* Create handle for cursor named name with the select statement. */
+
+static pghandle_t *
+create_cursor (PGconn *conn, char *name, int fetchcount, char *select)
+{
+
+	/* Postgres handle returned. */
+	pghandle_t *r;
+
+	/* Declare statement string. */
+	char *declare_select;
+
+	/* Declare command. */
+	char *declare_cmd;
+
+	/* Fetch select statement string. */
+	char *fetch_select;
+
+	/* Fetch command. */
+	char *fetch_cmd;
+
+	/* Close select statement string. */
+	char *close_select;
+
+	/* Close command. */
+	char *close_cmd;
+
+	/* Create handle. */
+	r = new (pghandle_t);
+
+	/* Wrap the select into a cursor declaration. */
+	declare_select = "DECLARE %s CURSOR FOR %s";
+	declare_cmd = (char *) allocate (strlen (declare_select) +
+		strlen (name) + strlen (select) + 1);
+	(void) sprintf (declare_cmd, declare_select, name, select);
+
+	/* Build fetch SQL statement similarly. */
+	fetch_select = "FETCH %d FROM %s";
+	fetch_cmd = (char *) allocate (strlen (fetch_select) + strlen (name) +
+		1024);
+	(void) sprintf (fetch_cmd, fetch_select, fetchcount, name);
+
+	/* Close command. */
+	close_select = "CLOSE %s";
+	close_cmd = (char *) allocate (strlen (close_select) + strlen (name) + 1);
+	(void) sprintf (close_cmd, close_select, name);
+
+	/* Update return object. */
+	r->conn = conn;
+	r->res = NULL;
+	r->select_cmd = declare_cmd;
+	r->fetch_cmd = fetch_cmd;
+	r->close_cmd = close_cmd;
+	r->nrows = 0;
+	r->nfields = 0;
+	r->pending = false;
+	r->format = binary ? 1 : 0;
+	r->stmt_name = NULL;
+	r->open = false;
+	r->name = strdup (name);
+	if (r->name == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+	r->fetchcount = fetchcount;
+	r->asked = fetchcount;
+	r->done = false;
+	r->kind = KIND_FILES;
+	r->plan_select = NULL;
+	return (r);
+}
+
+/* Declare cursor named name for the select statement, handle returned. */
+
+static pghandle_t *
+declare_cursor (PGconn *conn, char *name, int fetchcount, char *select)
+{
+
+	/* Postgres handle returned. */
+	pghandle_t *r;
+
+	/* Postgres exec result. */
+	PGresult *res;
+
+	/* Time the declaration took. */
+	double t;
+
+	r = create_cursor (conn, name, fetchcount, select);
+
+	/* Issue the SQL. */
+	if (debug > 5)
+	{
+		msg ("%s", r->select_cmd);
+		explain (conn, select, 0, NULL);
+	}
+	capture_plan (conn, select, 0, NULL);
+	t = clock_seconds ();
+	res = pcmd (conn, r->select_cmd);
+	count_stat (STAT_OPEN, clock_seconds () - t, NULL);
+	PQclear (res);
+	r->open = true;
+	return (r);
+}
+
+/* Prepare cursor named name for the select statement with parameter $1,
+   to be opened with open_cursor. */
+
+static pghandle_t *
+prepare_cursor (PGconn *conn, char *name, int fetchcount, char *select)
+{
+
+	/* Postgres handle returned. */
+	pghandle_t *r;
+
+	/* Statement name sprintf string. */
+	char *stmt_select;
+
+	r = create_cursor (conn, name, fetchcount, select);
+	stmt_select = "ifind_%s";
+	r->stmt_name = (char *) allocate (strlen (stmt_select) + strlen (name) +
+		1);
+	(void) sprintf (r->stmt_name, stmt_select, name);
+
+	/* The declaration is parsed once, only planned when opened. */
+	if (debug > 5)
+	{
+		msg ("%s", r->select_cmd);
+	}
+	prepare (conn, r->stmt_name, r->select_cmd, INT8OID);
+	if (plan_fd >= 0)
+	{
+		r->plan_select = strdup (select);
+		if (r->plan_select == NULL)
+		{
+			err (FAILURE, "Function strdup failed");
+		}
+	}
+	return (r);
+}
+
+/* Length of a key parameter. */
+#define KEY_LENGTH ((int) 32)
+
+/* Open prepared cursor with the id as parameter. */
+
+static void
+open_cursor (pghandle_t *h, long long unsigned id)
+{
+	PGresult *res;
+	char value[KEY_LENGTH];
+	char *values[1];
+	double t;
+
+	/* The plan for the first id stands for all. */
+	if (h->plan_select != NULL)
+	{
+		(void) sprintf (value, "%llu", id);
+		values[0] = value;
+		capture_plan (h->conn, h->plan_select, 1, values);
+		free (h->plan_select);
+		h->plan_select = NULL;
+	}
+	t = clock_seconds ();
+	res = pcmd_prepared (h->conn, h->stmt_name, id);
+	count_stat (STAT_OPEN, clock_seconds () - t, NULL);
+	PQclear (res);
+	h->open = true;
+	h->done = false;
+	h->nrows = 0;
+	h->nfields = 0;
+}
+
+/* Issue select for directories. */
+
+static pghandle_t *
+select_directories (PGconn *conn, int sorted, int fetchcount)
+{
+	pghandle_t *r;
+	char *colls_cmd;
+
+	colls_cmd = directories_sql (sorted);
+	r = declare_cursor (conn, "c", fetchcount, colls_cmd);
+	r->kind = KIND_DIRS;
+	free (colls_cmd);
+	return (r);
+}
+
+/* Build select statement for files in a directory, the collection id
+   is parameter $1. */
+
+static char *
+files_sql (int sorted)
+{
+
+	/* Files select statement sprintf string. */
+	char *files_select;
+
+	/* Files select statement created. */
+	char *files_cmd;
+
+	/* Conditions on the path names, of the expression and metadata, and
+	   the replica policy. */
+	char *filter;
+	char *where;
+	char *meta;
+	char *policy;
+
+	/* Build sprintf string to create select statement. */
+	if (sorted == 3 || sorted == 4)
+	{
+
+		/* Unique file names. */
+		files_select =
+			"SELECT DISTINCT ON (data_name) \
+data_id,data_size,data_name \
+FROM r_data_main WHERE coll_id=$1";
+	}
+	else
+	{
+
+		/* Default case, show all matches. There will be replicas. */
+		files_select = "SELECT \
+data_id,data_size,data_name \
+FROM r_data_main WHERE coll_id=$1";
+	}
+
+	/* The collection name is looked up once for the statement. */
+	filter = path_filter_sql ("(SELECT coll_name FROM r_coll_main \
+WHERE coll_id=$1)||'/'||data_name");
+	where = expr_filter_sql ("", "(SELECT coll_name FROM r_coll_main \
+WHERE coll_id=$1)");
+	meta = avu_filter_sql ("data_id");
+	policy = replica_policy_sql ("r_data_main.", "(SELECT coll_name \
+FROM r_coll_main WHERE coll_id=$1)");
+
+	/* Create target, should be long enough. */
+	files_cmd = (char *) allocate (strlen (files_select) + strlen (filter) +
+		strlen (where) + strlen (meta) + strlen (policy) +
+		(resource != NULL ? strlen (resource) : 0) +
+		(replica != NULL ? strlen (replica) : 0) + 1024);
+	(void) strcpy (files_cmd, files_select);
+
+	/* Add resource clause when needed. */
+	if (resource != NULL)
+	{
+		strcat (files_cmd, " AND RESC_NAME = '");
+		strcat (files_cmd, resource);
+		strcat (files_cmd, "'");
+	}
+
+	/* Add replica clause if specified. The replica number is actually
+	   a string! */
+	if (replica != NULL)
+	{
+
+		/* Replica number was specified. */
+		strcat (files_cmd, " AND DATA_REPL_NUM = '");
+		strcat (files_cmd, replica);
+		strcat (files_cmd, "'");
+	}
+	strcat (files_cmd, filter);
+	free (filter);
+	strcat (files_cmd, where);
+	free (where);
+	strcat (files_cmd, meta);
+	free (meta);
+	strcat (files_cmd, policy);
+	free (policy);
+	(void) changed_sql (files_cmd + strlen (files_cmd), "", "data_id");
+
+	/* Add sort clause if specified. */
+	if (sorted == 0)
+	{
+		;
+	}
+	else if (sorted == 1)
+	{
+		strcat (files_cmd,  " ORDER BY data_name ASC");
+	}
+	else if (sorted == 2)
+	{
+		strcat (files_cmd,  " ORDER BY data_name DESC");
+	}
+	else if (sorted == 3)
+	{
+		strcat (files_cmd,  " ORDER BY data_name ASC");
+	}
+	else if (sorted == 4)
+	{
+		strcat (files_cmd,  " ORDER BY data_name DESC");
+	}
+	else
+	{
+		err (FAILURE, "Wrong sort option");
+	}
+
+	return (files_cmd);
+}
+
+/* Prepare select for files in a directory, open_cursor with the
+   collection id issues it. */
+
+static pghandle_t *
+select_files (PGconn *conn, int sorted, int fetchcount)
+{
+	pghandle_t *r;
+	char *files_cmd;
+
+	files_cmd = files_sql (sorted);
+	r = prepare_cursor (conn, "d", fetchcount, files_cmd);
+	free (files_cmd);
+	return (r);
+}
+
+/* Build the conditions on the files of the tree join, the resource,
+   the replica, the path names, the expression, the metadata and the
+   replica policy. */
+
+static char *
+tree_filter_sql (void)
+{
+	char *r;
+	char *filter;
+	char *where;
+	char *meta;
+
+	char *policy;
+
+	filter = path_filter_sql ("c.coll_name||'/'||d.data_name");
+	where = expr_filter_sql ("d.", "c.coll_name");
+	meta = avu_filter_sql ("d.data_id");
+	policy = replica_policy_sql ("d.", "c.coll_name");
+	r = (char *) allocate (strlen (filter) + strlen (where) + strlen (meta) +
+		strlen (policy) + (resource != NULL ? strlen (resource) : 0) +
+		(replica != NULL ? strlen (replica) : 0) + 1024);
+	*r = EOS;
+
+	/* Add resource clause when needed. */
+	if (resource != NULL)
+	{
+		strcat (r, " AND d.resc_name = '");
+		strcat (r, resource);
+		strcat (r, "'");
+	}
+
+	/* Add replica clause if specified. */
+	if (replica != NULL)
+	{
+		strcat (r, " AND d.data_repl_num = '");
+		strcat (r, replica);
+		strcat (r, "'");
+	}
+	strcat (r, filter);
+	free (filter);
+	strcat (r, where);
+	free (where);
+	strcat (r, meta);
+	free (meta);
+	strcat (r, policy);
+	free (policy);
+	(void) changed_sql (r + strlen (r), "d.", "d.data_id");
+	return (r);
+}
+
+/* Build select statement for all files in the directory tree with
+   one join. */
+
+static char *
+tree_sql (int sorted)
+{
+
+	/* Collections of the tree. */
+	char *colls;
+
+	/* Files select statement sprintf string. */
+	char *tree_select;
+
+	/* Files select statement created. */
+	char *tree_cmd;
+
+	/* Conditions on the files. */
+	char *filter;
+
+	/* Build sprintf string to create select statement. The columns are
+	   the same as for select_files with the collection name appended,
+	   then the collection id and replica number which the keyset scan
+	   uses as key, and when watching the time of the change. */
+	if (sorted == 3 || sorted == 4)
+	{
+
+		/* Unique file names within each collection. */
+		tree_select = "SELECT \
+DISTINCT ON (c.coll_name,d.data_name) \
+d.data_id,d.data_size,d.data_name,c.coll_name,c.coll_id,d.data_repl_num%s \
+FROM %s c,r_data_main d WHERE d.coll_id=c.coll_id";
+	}
+	else
+	{
+
+		/* Default case, show all matches. There will be replicas. */
+		tree_select = "SELECT \
+d.data_id,d.data_size,d.data_name,c.coll_name,c.coll_id,d.data_repl_num%s \
+FROM %s c,r_data_main d WHERE d.coll_id=c.coll_id";
+	}
+
+	/* Create sprintf target, should be long enough. */
+	colls = colls_sql ();
+	filter = tree_filter_sql ();
+	tree_cmd = (char *) allocate (strlen (tree_select) + strlen (colls) +
+		strlen (filter) + 1024);
+
+	/* Create SQL statement. */
+	(void) sprintf (tree_cmd, tree_select, watch_seconds > 0 ?
+		CHANGED_DATA : "", colls);
+	free (colls);
+	strcat (tree_cmd, filter);
+	free (filter);
+
+	/* Add sort clause if specified. Sorting by collection first gives
+	   the same order as walking the sorted directories one by one. */
+	if (sorted == 0)
+	{
+		;
+	}
+	else if (sorted == 1 || sorted == 3)
+	{
+		strcat (tree_cmd,  " ORDER BY c.coll_name ASC,d.data_name ASC");
+	}
+	else if (sorted == 2 || sorted == 4)
+	{
+		strcat (tree_cmd,  " ORDER BY c.coll_name DESC,d.data_name DESC");
+	}
+	else
+	{
+		err (FAILURE, "Wrong sort option %d", sorted);
+	}
+	return (tree_cmd);
+}
+
+/* Issue select for all files in the directory tree with one join. */
+
+static pghandle_t *
+select_tree (PGconn *conn, int sorted, int fetchcount)
+{
+	pghandle_t *r;
+	char *tree_cmd;
+
+	tree_cmd = tree_sql (sorted);
+	r = declare_cursor (conn, "f", fetchcount, tree_cmd);
+	free (tree_cmd);
+	return (r);
+}
+
+/* Count directories in the tree, the join scan does not see them. */
+
+static long long unsigned
+count_directories (PGconn *conn)
+{
+	long long unsigned r;
+	char *colls;
+	char *count_select;
+	char *count_cmd;
+	PGresult *res;
+
+	colls = colls_sql ();
+	count_select = "SELECT count(*) FROM %s c";
+	count_cmd = (char *) allocate (strlen (count_select) +
+		strlen (colls) + 1);
+	(void) sprintf (count_cmd, count_select, colls);
+	free (colls);
+	res = pcmd (conn, count_cmd);
+	r = (long long unsigned) atoll (PQgetvalue (res, 0, 0));
+	PQclear (res);
+	free (count_cmd);
+	return (r);
+}
+
+/* Limits of the adapted fetch size. */
+#define ADAPT_MIN_ROWS ((int) 16)
+#define ADAPT_MAX_ROWS ((int) 1048576)
+
+/* Adapt the fetch size after a full batch which took t seconds. The
+   rows a fetch returns in the target time at the rate seen, no more
+   than fit the target memory at the row size seen, or as many as fit
+   without a target time. One fetch may be an outlier, so the size
+   changes at most four times at once. */
+
+static void
+adapt_fetchcount (pghandle_t *h, double t)
+{
+	double rows;
+	double row_bytes;
+
+	row_bytes = (double) result_size (h->res) / (double) h->nrows;
+	if (adapt_time > 0.0)
+	{
+		if (t < 1e-6)
+		{
+			t = 1e-6;
+		}
+		rows = (double) h->nrows * adapt_time / t;
+	}
+	else
+	{
+		rows = adapt_memory / row_bytes;
+	}
+	if (rows * row_bytes > adapt_memory)
+	{
+		rows = adapt_memory / row_bytes;
+	}
+	if (rows > 4.0 * (double) h->fetchcount)
+	{
+		rows = 4.0 * (double) h->fetchcount;
+	}
+	if (rows < (double) h->fetchcount / 4.0)
+	{
+		rows = (double) h->fetchcount / 4.0;
+	}
+	if (rows < (double) ADAPT_MIN_ROWS)
+	{
+		rows = (double) ADAPT_MIN_ROWS;
+	}
+	if (rows > (double) ADAPT_MAX_ROWS)
+	{
+		rows = (double) ADAPT_MAX_ROWS;
+	}
+	h->fetchcount = (int) rows;
+}
+
+/* Note the size of a fetch for the statistics. */
+
+static void
+count_fetch (int kind, int rows)
+{
+	int b;
+
+	b = 0;
+	while (rows > 1 && b < FETCH_BUCKETS - 1)
+	{
+		rows >>= 1;
+		b++;
+	}
+	fetch_sizes[kind][b]++;
+}
+
+/* Issue fetch. */
+
+static void
+fetch (pghandle_t *h)
+{
+
+	/* Time the fetch took. */
+	double t;
+
+	/* Free memory from the previous fetch if any. */
+	PQclear (h->res);
+	h->res = NULL;
+
+	/* A short batch means the cursor is done, no need to ask again. */
+	if (h->done)
+	{
+		h->nrows = 0;
+		h->nfields = 0;
+		return;
+	}
+
+	/* Issue the fetch, or collect the one sent before. Only the wait
+	   for it counts, the database worked on it while the last batch
+	   was processed. */
+	if (h->pending)
+	{
+		t = clock_seconds ();
+		h->res = pcollect (h->conn, h->fetch_cmd);
+		h->pending = false;
+		t = clock_seconds () - t;
+	}
+	else
+	{
+		h->asked = h->fetchcount;
+		(void) sprintf (h->fetch_cmd, "FETCH %d FROM %s", h->asked, h->name);
+		t = clock_seconds ();
+		h->res = pcmd_format (h->conn, h->fetch_cmd, h->format);
+		t = clock_seconds () - t;
+	}
+
+	/* Update indicators. */
+	count_stat (STAT_FETCH, t, h->res);
+	h->nfields = PQnfields (h->res);
+	h->nrows = PQntuples (h->res);
+	if (debug > 5)
+	{
+		if (h->nrows != 0)
+		{
+			msg ("    %s %8d", h->fetch_cmd, h->nrows);
+		}
+	}
+	count_fetch (h->kind, h->asked);
+	if (h->nrows < h->asked)
+	{
+		h->done = true;
+	}
+	else if (adaptive)
+	{
+		adapt_fetchcount (h, t);
+	}
+
+	/* Send the next fetch now so the database works on it while this
+	   batch is processed. */
+	if (prefetch && ! h->done)
+	{
+		h->asked = h->fetchcount;
+		(void) sprintf (h->fetch_cmd, "FETCH %d FROM %s", h->asked, h->name);
+		psend (h->conn, h->fetch_cmd, h->format);
+		h->pending = true;
+	}
+}
+
+/* Issue close cursor, a prepared cursor can be opened again. */
+
+static void
+endcursor (pghandle_t *h)
+{
+
+	/* Time the close took. */
+	double t;
+
+	/* Discard the prefetched batch if any. */
+	if (h->pending)
+	{
+		PQclear (h->res);
+		h->res = pcollect (h->conn, h->fetch_cmd);
+		h->pending = false;
+	}
+	PQclear (h->res);
+
+	/* Issue the close cursor. */
+	t = clock_seconds ();
+	h->res = pcmd (h->conn, h->close_cmd);
+	count_stat (STAT_CLOSE, clock_seconds () - t, NULL);
+
+	/* Free memory. */
+	PQclear (h->res);
+	h->res = NULL;
+	h->nrows = 0;
+	h->nfields = 0;
+	h->open = false;
+	h->done = false;
+}
+
+/* Issue close cursor and finish select. */
+
+static void
+closecursor (pghandle_t *h)
+{
+	PGresult *res;
+	char *dealloc_cmd;
+
+	if (h->open)
+	{
+		endcursor (h);
+	}
+
+	/* The next scan on the connection prepares it again. */
+	if (h->stmt_name != NULL)
+	{
+		dealloc_cmd = (char *) allocate (strlen (h->stmt_name) + 32);
+		(void) sprintf (dealloc_cmd, "DEALLOCATE %s", h->stmt_name);
+		res = PQexec (h->conn, dealloc_cmd);
+		PQclear (res);
+		free (dealloc_cmd);
+	}
+
+	/* Free more memory. */
+	h->conn = NULL;
+	h->res = NULL;
+	free (h->select_cmd);
+	free (h->fetch_cmd);
+	free (h->close_cmd);
+	h->select_cmd = NULL;
+	h->fetch_cmd = NULL;
+	h->close_cmd = NULL;
+	free (h->stmt_name);
+	h->stmt_name = NULL;
+	free (h->name);
+	h->name = NULL;
+	free (h->plan_select);
+	h->plan_select = NULL;
+	free (h);
+}
+
+/* Run one page of the keyset scan, reconnect when the connection is lost.
+   The select has the last key as parameters. */
+
+static PGresult *
+keyset_page (PGconn *conn, char *select, int nparams, char **values)
+{
+	PGresult *res;
+	ExecStatusType pstat;
+	double t;
+
+	while (true)
+	{
+		t = clock_seconds ();
+		res = PQexecParams (conn, select, nparams, NULL,
+			(const char * const *) values, NULL, NULL, binary ? 1 : 0);
+		t = clock_seconds () - t;
+		dbwait += t;
+		pstat = PQresultStatus (res);
+		if (pstat == PGRES_TUPLES_OK)
+		{
+			count_stat (STAT_QUERY, t, res);
+			return (res);
+		}
+		PQclear (res);
+		if (PQstatus (conn) != CONNECTION_BAD)
+		{
+			perr (PGRESEXEC, conn, "Error %s executing '%s'",
+				PQresStatus (pstat), select);
+		}
+		reconnect (conn);
+	}
+}
+
+/* Copy key column of the last row as text parameter for the next page. */
+
+static void
+keyset_key (char *key, PGresult *res, int row, int col)
+{
+	if (binary)
+	{
+		(void) sprintf (key, "%llu", value_id (PQgetvalue (res, row, col),
+			PQgetlength (res, row, col), 1));
+	}
+	else
+	{
+		(void) strncpy (key, PQgetvalue (res, row, col), KEY_LENGTH);
+		key[KEY_LENGTH - 1] = EOS;
+	}
+}
+
+/* Build keyset page query from a select without ORDER BY. */
+
+static char *
+keyset_sql (char *select, char *key, int fetchcount)
+{
+	char *keyset_select;
+	char *r;
+
+	keyset_select = "%s AND %s LIMIT %d";
+	r = (char *) allocate (strlen (keyset_select) + strlen (select) +
+		strlen (key) + 1024);
+	(void) sprintf (r, keyset_select, select, key, fetchcount);
+	return (r);
+}
+
+/* Show progress */
+
+static void
+show_progress (long long unsigned fetches)
+{
+	long long unsigned seen;
+	long long unsigned expected;
+	double elapsed;
+	long long unsigned eta;
+
+	if (progress > 0 && estimate_rows > 0)
+	{
+
+		/* With an estimate the share seen and the time left at the rate
+		   so far. A parallel scan process sees its part. */
+		if ((fetches % ((long long unsigned) progress)) ==
+			(long long unsigned) 0)
+		{
+			seen = dirsonly ? dbc->dno : dbc->fno;
+			expected = estimate_rows / (nparts > 0 ? nparts : 1);
+			if (seen >= expected)
+			{
+				expected = seen + 1;
+			}
+			elapsed = clock_seconds () - dbc->startclock;
+			eta = seen > 0 ? (long long unsigned) (elapsed *
+				(double) (expected - seen) / (double) seen) : 0;
+			msg ("Progress %5.1f%%, %llu of about %llu, ETA %llu:%02llu:%02llu",
+				100.0 * (double) seen / (double) expected, seen, expected,
+				eta / 3600, (eta / 60) % 60, eta % 60);
+		}
+	}
+	else if (progress > 0)
+	{
+
+		/* We got the number of fetches, one fetch should get batchsize
+		   records, sometimes less. */
+		if ((fetches % ((long long unsigned) progress)) ==
+			(long long unsigned) 0)
+		{
+			pmsg (".");
+		}
+	}
+}
+
+/* Number of records in the COPY ring. */
+#define COPY_RING ((int) 64)
+
+/* Maximum number of fields in a COPY record. */
+#define COPY_FIELDS ((int) 8)
+
+/* Parsed COPY record. */
+typedef struct copyrec {
+
+	/* Decoded field data, PATHNAME_LENGTH bytes. */
+	char *buf;
+
+	/* Fields pointing into the buffer, NULL for SQL NULL. */
+	char *fields[COPY_FIELDS];
+
+	/* Field lengths. */
+	int lens[COPY_FIELDS];
+
+	/* Number of fields. */
+	int nfields;
+} copyrec_t;
+
+/* COPY stream with a fixed size ring of parsed records. */
+typedef struct copyring {
+
+	/* Postgres connection structure. */
+	PGconn *conn;
+
+	/* COPY command. */
+	char *copy_cmd;
+
+	/* Records. */
+	copyrec_t *recs;
+
+	/* First record not yet processed and number of records. */
+	int first;
+	int count;
+
+	/* End of data seen. */
+	int done;
+
+	/* Format, 0 text, 1 binary. */
+	int format;
+
+	/* Binary header seen. */
+	int header;
+} copyring_t;
+
+/* Start COPY of the select statement to the client. */
+
+static copyring_t *
+copy_open (PGconn *conn, char *select)
+{
+	copyring_t *r;
+	char *copy_select;
+	PGresult *res;
+	int i;
+
+	r = new (copyring_t);
+	if (binary)
+	{
+		copy_select = "COPY (%s) TO STDOUT WITH (FORMAT binary)";
+	}
+	else
+	{
+		copy_select = "COPY (%s) TO STDOUT";
+	}
+	r->copy_cmd = (char *) allocate (strlen (copy_select) +
+		strlen (select) + 1);
+	(void) sprintf (r->copy_cmd, copy_select, select);
+	if (debug > 5)
+	{
+		msg ("%s", r->copy_cmd);
+		explain (conn, select, 0, NULL);
+	}
+	capture_plan (conn, select, 0, NULL);
+
+	/* The result of the COPY command is PGRES_COPY_OUT. */
+	res = PQexec (conn, r->copy_cmd);
+	if (PQresultStatus (res) != PGRES_COPY_OUT)
+	{
+		perr (PGRESEXEC, conn, "Error %s executing '%s'",
+			PQresStatus (PQresultStatus (res)), r->copy_cmd);
+	}
+	PQclear (res);
+
+	/* The ring is allocated once, memory stays fixed. */
+	r->recs = (copyrec_t *) allocate (COPY_RING * sizeof (copyrec_t));
+	for (i=0; i<COPY_RING; i++)
+	{
+		r->recs[i].buf = (char *) allocate (PATHNAME_LENGTH);
+		r->recs[i].nfields = 0;
+	}
+	r->conn = conn;
+	r->first = 0;
+	r->count = 0;
+	r->done = false;
+	r->format = binary ? 1 : 0;
+	r->header = false;
+	return (r);
+}
+
+/* Parse a line of COPY text format into the record. */
+
+static void
+copy_parse (copyrec_t *rec, char *line, int len)
+{
+	char *ip;
+	char *end;
+	char *op;
+	int n;
+	int v;
+
+	if (len >= PATHNAME_LENGTH)
+	{
+		err (FAILURE, "COPY record too long (%d)", len);
+	}
+	ip = line;
+	end = line + len;
+	op = rec->buf;
+	rec->nfields = 0;
+	rec->fields[rec->nfields++] = op;
+
+	/* Fields are separated by tabs, the line ends with new line. */
+	while (ip < end && *ip != '\n')
+	{
+		if (*ip == '\t')
+		{
+			rec->lens[rec->nfields - 1] = (int) (op - rec->fields[rec->nfields - 1]);
+			*op++ = EOS;
+			if (rec->nfields >= COPY_FIELDS)
+			{
+				err (FAILURE, "Too many COPY fields - confused");
+			}
+			rec->fields[rec->nfields++] = op;
+			ip++;
+		}
+		else if (*ip == '\\' && ip + 1 < end)
+		{
+
+			/* Backslash escapes. */
+			ip++;
+			switch (*ip)
+			{
+			case 'N':
+				rec->fields[rec->nfields - 1] = NULL;
+				*op++ = EOS;
+				ip++;
+				break;
+			case 'b':
+				*op++ = '\b';
+				ip++;
+				break;
+			case 'f':
+				*op++ = '\f';
+				ip++;
+				break;
+			case 'n':
+				*op++ = '\n';
+				ip++;
+				break;
+			case 'r':
+				*op++ = '\r';
+				ip++;
+				break;
+			case 't':
+				*op++ = '\t';
+				ip++;
+				break;
+			case 'v':
+				*op++ = '\v';
+				ip++;
+				break;
+			case 'x':
+
+				/* One or two hex digits. */
+				ip++;
+				v = 0;
+				for (n=0; n<2 && ip < end && isxdigit ((unsigned char) *ip); n++)
+				{
+					v = v * 16 + (isdigit ((unsigned char) *ip) ?
+						*ip - '0' : tolower ((unsigned char) *ip) - 'a' + 10);
+					ip++;
+				}
+				*op++ = (char) v;
+				break;
+			default:
+				if (*ip >= '0' && *ip <= '7')
+				{
+
+					/* One to three octal digits. */
+					v = 0;
+					for (n=0; n<3 && ip < end && *ip >= '0' && *ip <= '7'; n++)
+					{
+						v = v * 8 + (*ip - '0');
+						ip++;
+					}
+					*op++ = (char) v;
+				}
+				else
+				{
+
+					/* Any other character is taken literally. */
+					*op++ = *ip++;
+				}
+				break;
+			}
+		}
+		else
+		{
+			*op++ = *ip++;
+		}
+	}
+	rec->lens[rec->nfields - 1] = (int) (op - rec->fields[rec->nfields - 1]);
+	*op = EOS;
+	for (n=0; n<rec->nfields; n++)
+	{
+		if (rec->fields[n] == NULL)
+		{
+			rec->lens[n] = -1;
+		}
+	}
+}
+
+/* Signature of the binary COPY format. */
+#define COPY_SIGNATURE "PGCOPY\n\377\r\n\0"
+#define COPY_SIGNATURE_LENGTH ((int) 11)
+
+/* Big endian integer from the binary COPY format. */
+
+static int
+copy_int (char *p, int len)
+{
+	long long unsigned v;
+
+	v = value_id (p, len, 1);
+	if (len == 2)
+	{
+		return ((int) (short) (unsigned short) v);
+	}
+	return ((int) (unsigned int) v);
+}
+
+/* Parse a tuple of COPY binary format into the record, returns false
+   for the trailer. */
+
+static int
+copy_parse_binary (copyring_t *r, copyrec_t *rec, char *line, int len)
+{
+	char *ip;
+	char *end;
+	char *op;
+	int n;
+	int i;
+	int flen;
+
+	if (len >= PATHNAME_LENGTH)
+	{
+		err (FAILURE, "COPY record too long (%d)", len);
+	}
+	ip = line;
+	end = line + len;
+
+	/* The first message has the header, signature, flags and extension. */
+	if (! r->header)
+	{
+		if (len < COPY_SIGNATURE_LENGTH + 8 ||
+			memcmp (ip, COPY_SIGNATURE, COPY_SIGNATURE_LENGTH) != 0)
+		{
+			err (FAILURE, "Bad COPY binary header - confused");
+		}
+		ip += COPY_SIGNATURE_LENGTH + 4;
+		ip += 4 + copy_int (ip, 4);
+		r->header = true;
+	}
+
+	/* Field count, -1 is the trailer. */
+	if (ip + 2 > end)
+	{
+		err (FAILURE, "Short COPY binary tuple - confused");
+	}
+	n = copy_int (ip, 2);
+	ip += 2;
+	if (n < 0)
+	{
+		return (false);
+	}
+	if (n > COPY_FIELDS)
+	{
+		err (FAILURE, "Too many COPY fields - confused");
+	}
+
+	/* Each field is a length and the bytes, copied with an EOS added. */
+	op = rec->buf;
+	rec->nfields = n;
+	for (i=0; i<n; i++)
+	{
+		flen = copy_int (ip, 4);
+		ip += 4;
+		if (flen < 0)
+		{
+			rec->fields[i] = NULL;
+			rec->lens[i] = -1;
+			continue;
+		}
+		if (ip + flen > end)
+		{
+			err (FAILURE, "Short COPY binary field - confused");
+		}
+		memcpy (op, ip, (size_t) flen);
+		rec->fields[i] = op;
+		rec->lens[i] = flen;
+		op += flen;
+		*op++ = EOS;
+		ip += flen;
+	}
+	return (true);
+}
+
+/* Fill the ring with the rows available, wait only when it is empty. */
+
+static void
+copy_fill (copyring_t *r)
+{
+	char *line;
+	int len;
+	int sock;
+	fd_set fds;
+	double t;
+	PGresult *res;
+	copyrec_t *rec;
+
+	while (r->count < COPY_RING && ! r->done)
+	{
+		len = PQgetCopyData (r->conn, &line, true);
+		if (len > 0)
+		{
+
+			/* Parse into the next free slot. */
+			rec = &r->recs[(r->first + r->count) % COPY_RING];
+			if (r->format == 0)
+			{
+				copy_parse (rec, line, len);
+				r->count++;
+			}
+			else if (copy_parse_binary (r, rec, line, len))
+			{
+				r->count++;
+			}
+			PQfreemem (line);
+		}
+		else if (len == 0)
+		{
+
+			/* Nothing buffered. Process what we have, else wait. */
+			if (r->count > 0)
+			{
+				break;
+			}
+			t = clock_seconds ();
+			sock = PQsocket (r->conn);
+			FD_ZERO (&fds);
+			FD_SET (sock, &fds);
+			if (select (sock + 1, &fds, NULL, NULL, NULL) < 0 && errno != EINTR)
+			{
+				err (FAILURE, "Function select failed - confused");
+			}
+			if (! PQconsumeInput (r->conn))
+			{
+				perr (PGRESEXEC, r->conn, "Error reading '%s'", r->copy_cmd);
+			}
+			dbwait += clock_seconds () - t;
+		}
+		else if (len == -1)
+		{
+
+			/* End of data, check the final status of COPY. */
+			r->done = true;
+			res = PQgetResult (r->conn);
+			if (PQresultStatus (res) != PGRES_COMMAND_OK)
+			{
+				perr (PGRESEXEC, r->conn, "Error %s executing '%s'",
+					PQresStatus (PQresultStatus (res)), r->copy_cmd);
+			}
+			PQclear (res);
+			res = PQgetResult (r->conn);
+			while (res != NULL)
+			{
+				PQclear (res);
+				res = PQgetResult (r->conn);
+			}
+		}
+		else
+		{
+			perr (PGRESEXEC, r->conn, "Error copying '%s'", r->copy_cmd);
+		}
+	}
+}
+
+/* Next record from the COPY stream, NULL at the end. */
+
+static copyrec_t *
+copy_next (copyring_t *r)
+{
+	copyrec_t *rec;
+
+	if (r->count == 0)
+	{
+		copy_fill (r);
+		if (r->count == 0)
+		{
+			return (NULL);
+		}
+		dbc->fetches++;
+		show_progress (dbc->fetches);
+	}
+	rec = &r->recs[r->first];
+	r->first = (r->first + 1) % COPY_RING;
+	r->count--;
+	return (rec);
+}
+
+/* Finish COPY stream and free memory. */
+
+static void
+copy_close (copyring_t *r)
+{
+	int i;
+
+	for (i=0; i<COPY_RING; i++)
+	{
+		free (r->recs[i].buf);
+	}
+	free (r->recs);
+	free (r->copy_cmd);
+	free (r);
+}
+
+/* Check if pathname is a UTF-8 string. */
+
+static int
+is_utf (char *pathname)
+{
+	size_t l;
+
+	l = mbstowcs (NULL, pathname, 0);
+	if (l == (size_t) -1)
+	{
+		return (false);
+	}
+	else
+	{
+		return (true);
+	}
+}
+
+/* Maximum number of tasks. */
+#define MAX_TASKS ((int) 64)
+
+/* Most command slots of the worker pool. */
+#define MAX_SLOTS ((int) 16384)
+
+/* Worker pool. The workers are processes started once, taking the
+   commands from one queue as soon as they are free: the scan writes a
+   command to a free slot of memory shared with them and the slot
+   number, a ticket, to the queue pipe. A worker done with a command
+   reports the slot back on the done pipe, the slot is free again. */
+typedef struct
+{
+
+	/* Number of workers and their pids. */
+	int ntasks;
+	pid_t *pids;
+
+	/* Command slots, shared, COMMAND_LENGTH bytes each. */
+	int nslots;
+	char *slots;
+
+	/* Free slots. */
+	int *free_slots;
+	int nfree;
+
+	/* Queue of tickets and done reports. */
+	int cmd_fds[2];
+	int done_fds[2];
+
+	/* Commands done and seconds busy by worker. */
+	long long unsigned *ncmds;
+	double *busy;
+
+	/* Start and end of the pool, seconds the scan waited for a free
+	   slot. */
+	double started;
+	double ended;
+	double stalled;
+} work_t;
+
+/* Report of a worker on a command done. */
+typedef struct
+{
+	int slot;
+	int task;
+	int status;
+	double busy;
+} done_t;
+
+/* Global variable, work descriptor of the worker pool. */
+work_t *work = NULL;
+
+/* Command slots of a worker pool, from the batch size. */
+static int work_slots = 0;
+
+/* Use of the worker pools ended, of this process and of the scan
+   processes: commands run, seconds busy, seconds the workers were there
+   and seconds the scans waited for them. */
+static int pools = 0;
+static long long unsigned pool_cmds = 0;
+static double pool_busy = 0.0;
+static double pool_capacity = 0.0;
+static double pool_stalled = 0.0;
+
+/* Running in a worker of the pool. */
+static int in_worker = false;
+
+/* Cleaning up. Refers global variable db. */
+
+static void
+cleanup (void)
+{
+	PGresult *res;
+
+	/* Update end time. */
+	dbc->endtime = time (NULL);
+	if (dbc->endtime == (time_t) -1)
+	{
+		err (FAILURE, "Error getting end time");
+	}
+
+	/* Roll back end finish. */
+	if (dbc->hf != NULL)
+	{
+		closecursor (dbc->hf);
+	}
+	if (dbc->hd != NULL)
+	{
+		closecursor (dbc->hd);
+	}
+	close_scans ();
+
+	/* The group being sent is rolled back, the committed ones stay. */
+	if (wconn != NULL)
+	{
+		PQfinish (wconn);
+	}
+	if (! keyset)
+	{
+		res = PQexec (dbc->conn, "ROLLBACK");
+		PQclear (res);
+	}
+	PQfinish (dbc->conn);
+	dbc->endclock = clock_seconds ();
+}
+
+/* Signal handler. */
+
+static void
+signal_handler (int signo)
+{
+	if (signo == SIGHUP || signo == SIGINT ||
+		signo == SIGQUIT || signo == SIGTERM)
+	{
+
+		/* Interrupt received, cleanup and exit. */
+		(void) fprintf (stderr, "Interrupted, cleaning up and exiting\n");
+		(void) fprintf (stderr, "Last path was: '%s'\n", dbc->last_path);
+		(void) fprintf (stderr, "Last command was: '%s'\n", dbc->last_command);
+		cleanup ();
+		print_summary (dbc);
+		exit (FAILURE);
+	}
+	else
+	{
+		(void) fprintf (stderr, "Interrupted, signal %d - confused\n", signo);
+		(void) fflush (stderr);
+	}
+}
+
+/* Establish signal handler. */
+
+static void
+siga (int s, struct sigaction *sa)
+{
+	int status;
+
+	sa->sa_handler = signal_handler;
+	status = sigemptyset (&sa->sa_mask);
+	if (status == -1)
+	{
+		err (FAILURE, "Error calling sigemptyset - confused");
+	}
+	sa->sa_flags = 0;
+	status = sigaction (s, sa, NULL);
+	if (status == -1)
+	{
+		err (FAILURE, "Error calling sigaction - confused");
+	}
+}
+
+/* Restore the default action of a signal. */
+
+static void
+sigd (int s)
+{
+	struct sigaction sa;
+
+	(void) memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = SIG_DFL;
+	if (sigemptyset (&sa.sa_mask) == -1 || sigaction (s, &sa, NULL) == -1)
+	{
+		err (FAILURE, "Error calling sigaction - confused");
+	}
+}
+
+/* Build the command using command string and pathname. */
+
+static void
+build_command (char *cmd, char *cmds, char *pathname)
+{
+	char *s;
+	char *state;
+	char *token;
+	int formats;
+
+	/* Null command string. */
+	if (cmds == NULL)
+	{
+		err (FAILURE, "Command string is null");
+	}
+
+	/* Check. */
+	if (strlen (cmds) == (size_t) 0)
+	{
+		err (FAILURE, "Empty command string in build_command");
+	}
+	if (index (pathname, 0x027) != NULL)
+	{
+		err (FAILURE, "Single quote detected in %s", pathname);
+	}
+
+	/* Enter command function. */
+	if (debug > 10)
+	{
+		msg ("Build command '%s' '%s'", cmds, pathname);
+	}
+
+	/* Count format items (starting with %). */
+	s = strdup (cmds);
+	if (s == NULL)
+	{
+		err (FAILURE, "Function strdup failed in build_command");
+	}
+	state = s;
+	formats = 0;
+	token = strsep (&state, "%");
+	while (token != NULL)
+	{
+		formats++;
+		token = strsep (&state, "%");
+	}
+	formats--;
+	if (formats < 0)
+	{
+		err (FAILURE, "Wrong formats in build_command - confused");
+	}
+	if (formats > 4)
+	{
+		err (FAILURE, "Too many formats in build_command");
+	}
+	free (s);
+
+	/* Build command. */
+	if ((strlen (cmds) + formats * (strlen (pathname) + 2) + 3) >
+		COMMAND_LENGTH)
+	{
+		err (FAILURE, "Strings too long for command");
+	}
+	switch (formats)
+	{
+	case 0:
+		(void) strcpy (cmd, cmds);
+		(void) strcat (cmd, " ");
+		(void) strcat (cmd, "'");
+		(void) strcat (cmd, pathname);
+		(void) strcat (cmd, "'");
+		break;
+	case 1:
+		(void) sprintf (cmd, cmds, pathname);
+		break;
+	case 2:
+		(void) sprintf (cmd, cmds, pathname, pathname);
+		break;
+	case 3:
+		(void) sprintf (cmd, cmds, pathname, pathname, pathname);
+		break;
+	case 4:
+		(void) sprintf (cmd, cmds, pathname, pathname, pathname, pathname);
+		break;
+	default:
+		err (FAILURE, "Bad formats in build_command - confused");
+		break;
+	}
+}
+
+/* Run command with retry. */
+
+int
+run_command (int retries, int period, char *cmd)
+{
+	int status;
+	int nretries;
+	int unslept;
+
+	if (retries <= 0)
+	{
+
+		/* Won't retry. Fail out when there was an error. */
+		status = system (cmd);
+		if (status == -1)
+		{
+
+			/* The system library function failed. */
+			err (FAILURE, "There was a system error running '%s'", cmd);
+		}
+		else
+		{
+			if (status != 0)
+			{
+
+				/* Non-zero returned from the command.
+				   Don't quit when forced, a worker reports it. */
+				if (! force && ! in_worker)
+				{
+
+					/* Abort will never return. */
+					err (FAILURE, "Error %d running '%s'", status, cmd);
+				}
+				return (status);
+			}
+			else
+			{
+
+				/* No error, status is 0, finish here. */
+				return (0);
+			}
+		}
+	}
+	else
+	{
+
+		/* Retry, there was an error. */
+		nretries = retries;
+		while (nretries > 0 && status != 0)
+		{
+
+			/* Wait. */
+			unslept = sleep (period);
+			if (unslept != 0)
+			{
+				err (FAILURE, "There was an error sleeping for '%s'", cmd);
+			}
+
+			/* Retry. */
+			status = system (cmd);
+			if (status == -1)
+			{
+				err (FAILURE, "There was a system error running '%s'", cmd);
+			}
+			else
+			{
+				if (status != 0)
+				{
+
+					/* Non-zero returned from the command. */
+					msg ("Error %d retrying '%s'", status, cmd);
+					if (retry_failures >= max_retry_failures)
+					{
+
+						/* Reached the limit. */
+						err (FAILURE,
+							"There were more than %d command retries - abort",
+							max_retry_failures);
+					}
+					retry_failures++;
+				}
+
+				/* We got zero status. */
+				return (0);
+			}
+		}
+
+		/* Still failing after so many retries. */
+		msg ("Command '%s' still failing after %d retries", cmd, retries);
+	}
+
+	/* Finish, with or without retries with the status of the last run. */
+	return (status);
+}
+
+/* Do command. */
+
+static int
+do_command (char *cmd)
+{
+	int status;
+
+	if (strlen (cmd) == 0)
+	{
+		err (FAILURE, "Command is the empty string", cmd);
+	}
+	if (debug > 10)
+	{
+		msg ("Running command '%s'", cmd);
+	}
+	if (test)
+	{
+		msg ("%s", cmd);
+	}
+	else
+	{
+
+		/* Take a note. The scan state is the parent's in a worker. */
+		if (! in_worker)
+		{
+			(void) strncpy (dbc->last_command, cmd, COMMAND_LENGTH);
+		}
+
+		/* Run the command with shell. */
+		if (retry)
+		{
+
+			/* Retry three times after waiting for 59 seconds. */
+			status = run_command (3, 59, cmd);
+		}
+		else
+		{
+			status = run_command (0, 0, cmd);
+		}
+		if (status == -1)
+		{
+			err (FAILURE, "There was an error running '%s'", cmd);
+		}
+		if (status != 0)
+		{
+
+			/* A worker reports it, the scan decides. */
+			if (in_worker && ! force)
+			{
+				return (status);
+			}
+			if (! force)
+			{
+				(void) fprintf (stderr, "Command failed, status %d\n", status);
+				(void) fprintf (stderr, "Command was: '%s'\n", cmd);
+				(void) fflush (stderr);
+				cleanup ();
+				print_summary (dbc);
+				err (FAILURE, "Command returned nonzero status %d", status);
+			}
+			else
+			{
+
+				/* Call system ignores SIGINT and SIGQUIT so
+				   extra magic needed. */
+				if (WIFSIGNALED (status))
+				{
+					if (WTERMSIG (status) == SIGHUP ||
+						WTERMSIG (status) == SIGINT ||
+						WTERMSIG (status) == SIGQUIT ||
+						WTERMSIG (status) == SIGTERM)
+					{
+
+						/* There was an interrupt. */
+						msg ("Interrupted %s", cmd);
+						if (in_worker)
+						{
+							exit (FAILURE);
+						}
+						cleanup ();
+						print_summary (dbc);
+						err (FAILURE, "Interrupted with %d", status);
+					}
+				}
+				else
+				{
+					(void) fprintf (stderr, "Error %d for '%s'\n", status, cmd);
+					(void) fflush (stderr);
+				}
+			}
+		}
+	}
+	return (status);
+}
+
+/* Worker of the pool, runs the commands of the tickets until the queue
+   is closed. */
+
+static void
+work_loop (work_t *w, int taskid)
+{
+	done_t d;
+	ssize_t n;
+	double t;
+
+	in_worker = true;
+	(void) close (w->cmd_fds[1]);
+	(void) close (w->done_fds[0]);
+
+	/* The parent cleans up its connections on an interrupt, a worker
+	   just ends. */
+	sigd (SIGHUP);
+	sigd (SIGINT);
+	sigd (SIGQUIT);
+	sigd (SIGTERM);
+	for (;;)
+	{
+		n = read (w->cmd_fds[0], &d.slot, sizeof (d.slot));
+		if (n == 0)
+		{
+			exit (SUCCESS);
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n != (ssize_t) sizeof (d.slot))
+		{
+			err (FAILURE, "Cannot read the queue of commands: %s",
+				strerror (errno));
+		}
+		if (debug > 5)
+		{
+			msg ("Task %d running slot %d", taskid, d.slot);
+		}
+		t = clock_seconds ();
+		d.status = do_command (w->slots + (size_t) d.slot * COMMAND_LENGTH);
+		d.busy = clock_seconds () - t;
+		d.task = taskid;
+
+		/* Smaller than PIPE_BUF, not mixed with the others. */
+		if (write (w->done_fds[1], &d, sizeof (d)) != (ssize_t) sizeof (d))
+		{
+			err (FAILURE, "Cannot report a command done: %s",
+				strerror (errno));
+		}
+	}
+}
+
+/* Start the worker pool of n workers with at least m command slots. */
+
+static work_t *
+create_work (int n, int m)
+{
+	work_t *r;
+	pid_t pid;
+	int i;
+
+	/* Check. */
+	if (n > MAX_TASKS || n <= 0)
+	{
+		err (FAILURE, "Wrong number of tasks (%d), should be 0 < n <= %d",
+			n, MAX_TASKS);
+	}
+	r = new (work_t);
+	r->ntasks = n;
+	r->nslots = m > 2 * n ? m : 2 * n;
+	if (r->nslots > MAX_SLOTS)
+	{
+		r->nslots = MAX_SLOTS;
+	}
+
+	/* Only the pages of the slots used are backed by memory. */
+	r->slots = (char *) mmap (NULL, (size_t) r->nslots * COMMAND_LENGTH,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (r->slots == (char *) MAP_FAILED)
+	{
+		err (FAILURE, "Cannot map command slots: %s", strerror (errno));
+	}
+	r->free_slots = (int *) allocate ((size_t) r->nslots * sizeof (int));
+	for (i=0; i<r->nslots; i++)
+	{
+		r->free_slots[i] = i;
+	}
+	r->nfree = r->nslots;
+	r->pids = (pid_t *) allocate ((size_t) n * sizeof (pid_t));
+	r->ncmds = (long long unsigned *) allocate ((size_t) n *
+		sizeof (long long unsigned));
+	r->busy = (double *) allocate ((size_t) n * sizeof (double));
+	if (pipe (r->cmd_fds) == -1 || pipe (r->done_fds) == -1)
+	{
+		err (FAILURE, "Cannot create pipes for the workers: %s",
+			strerror (errno));
+	}
+
+	/* The commands run do not keep the pipes open. */
+	for (i=0; i<2; i++)
+	{
+		(void) fcntl (r->cmd_fds[i], F_SETFD, FD_CLOEXEC);
+		(void) fcntl (r->done_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	(void) fflush (NULL);
+	for (i=0; i<n; i++)
+	{
+		r->ncmds[i] = (long long unsigned) 0;
+		r->busy[i] = 0.0;
+		pid = fork ();
+		if (pid < (pid_t) 0)
+		{
+			err (FAILURE, "Cannot fork task %d: %s", i, strerror (errno));
+		}
+		if (pid == (pid_t) 0)
+		{
+			work_loop (r, i);
+		}
+		r->pids[i] = pid;
+	}
+	(void) close (r->cmd_fds[0]);
+	(void) close (r->done_fds[1]);
+	(void) fcntl (r->cmd_fds[1], F_SETFL, O_NONBLOCK);
+	(void) fcntl (r->done_fds[0], F_SETFL, O_NONBLOCK);
+	r->started = clock_seconds ();
+	r->ended = 0.0;
+	r->stalled = 0.0;
+	return (r);
+}
+
+/* Take the reports of the commands done, waiting for one when asked.
+   A failed command ends the run unless forced, as it would running
+   without workers. */
+
+static void
+reap_work (work_t *w, int waiting)
+{
+	done_t d;
+	ssize_t n;
+	fd_set fds;
+	struct timeval tv;
+	int ready;
+	int i;
+
+	for (;;)
+	{
+		if (waiting)
+		{
+
+			/* Check every second that the workers are still there. */
+			FD_ZERO (&fds);
+			FD_SET (w->done_fds[0], &fds);
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+			ready = select (w->done_fds[0] + 1, &fds, NULL, NULL, &tv);
+			if (ready < 0 && errno != EINTR)
+			{
+				err (FAILURE, "Function select failed - confused");
+			}
+			if (ready <= 0)
+			{
+				for (i=0; i<w->ntasks; i++)
+				{
+					if (waitpid (w->pids[i], NULL, WNOHANG) == w->pids[i])
+					{
+						err (FAILURE, "Worker task %d ended - abort", i);
+					}
+				}
+				continue;
+			}
+		}
+		n = read (w->done_fds[0], &d, sizeof (d));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		{
+			return;
+		}
+		if (n == 0)
+		{
+			err (FAILURE, "The workers are gone");
+		}
+		if (n != (ssize_t) sizeof (d))
+		{
+			err (FAILURE, "Cannot read the commands done: %s",
+				strerror (errno));
+		}
+		w->ncmds[d.task]++;
+		w->busy[d.task] += d.busy;
+		if (d.status != 0 && ! force)
+		{
+			(void) fprintf (stderr, "Command failed, status %d\n", d.status);
+			(void) fprintf (stderr, "Command was: '%s'\n",
+				w->slots + (size_t) d.slot * COMMAND_LENGTH);
+			(void) fflush (stderr);
+			cleanup ();
+			print_summary (dbc);
+			err (FAILURE, "Command returned nonzero status %d", d.status);
+		}
+		w->free_slots[w->nfree++] = d.slot;
+
+		/* The rest without waiting. */
+		waiting = false;
+	}
+}
+
+/* Queue command for a worker. The scan goes on while the workers run
+   the commands, it waits only when all the slots are taken. */
+
+static void
+queue_command (work_t *w, char *cs)
+{
+	double t;
+	int slot;
+	fd_set fds;
+	struct timeval tv;
+
+	reap_work (w, false);
+	if (w->nfree == 0)
+	{
+		t = clock_seconds ();
+		while (w->nfree == 0)
+		{
+			reap_work (w, true);
+		}
+		w->stalled += clock_seconds () - t;
+	}
+	slot = w->free_slots[--w->nfree];
+	(void) snprintf (w->slots + (size_t) slot * COMMAND_LENGTH,
+		COMMAND_LENGTH, "%s", cs);
+	if (debug > 5)
+	{
+		msg ("Queueing slot %d", slot);
+	}
+
+	/* The queue pipe may hold fewer tickets than there are slots, one
+	   page when the pipes of the user take too much. While it is full
+	   the reports are read, a worker blocked writing one takes the next
+	   ticket then. */
+	t = 0.0;
+	while (write (w->cmd_fds[1], &slot, sizeof (slot)) != (ssize_t) sizeof (slot))
+	{
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			err (FAILURE, "Cannot queue a command: %s", strerror (errno));
+		}
+		if (t == 0.0)
+		{
+			t = clock_seconds ();
+		}
+		reap_work (w, false);
+		FD_ZERO (&fds);
+		FD_SET (w->cmd_fds[1], &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		(void) select (w->cmd_fds[1] + 1, NULL, &fds, NULL, &tv);
+	}
+	if (t > 0.0)
+	{
+		w->stalled += clock_seconds () - t;
+	}
+}
+
+/* Wait until the workers ran all the commands queued. */
+
+static void
+flush_queue (work_t *w)
+{
+	if (debug > 5 && w->nfree < w->nslots)
+	{
+		msg ("Flushing the queue");
+	}
+	while (w->nfree < w->nslots)
+	{
+		reap_work (w, true);
+	}
+}
+
+/* Check if a process is a worker of the pool. */
+
+static int
+is_worker (work_t *w, pid_t pid)
+{
+	int i;
+
+	if (w == NULL)
+	{
+		return (false);
+	}
+	for (i=0; i<w->ntasks; i++)
+	{
+		if (w->pids[i] == pid)
+		{
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/* Leave the pool to the process which started it, in a forked scan
+   process. */
+
+static void
+leave_work (work_t *w)
+{
+	(void) close (w->cmd_fds[1]);
+	(void) close (w->done_fds[0]);
+}
+
+/* Run the commands queued and stop the workers. */
+
+static void
+finish_work (work_t *w)
+{
+	int i;
+
+	flush_queue (w);
+	(void) close (w->cmd_fds[1]);
+	for (i=0; i<w->ntasks; i++)
+	{
+		while (waitpid (w->pids[i], NULL, 0) < 0 && errno == EINTR)
+		{
+			;
+		}
+	}
+	(void) close (w->done_fds[0]);
+	w->ended = clock_seconds ();
+}
+
+/* Add the use of a finished pool to the totals. */
+
+static void
+count_work (work_t *w)
+{
+	int i;
+
+	for (i=0; i<w->ntasks; i++)
+	{
+		pool_busy += w->busy[i];
+		pool_cmds += w->ncmds[i];
+		if (debug > 5)
+		{
+			msg ("%24llu commands, %.3f seconds busy by task %d",
+				w->ncmds[i], w->busy[i], i);
+		}
+	}
+	pool_capacity += (w->ended - w->started) * w->ntasks;
+	pool_stalled += w->stalled;
+	pools++;
+}
+
+/* Print the use of the workers of all the pools. */
+
+static void
+print_work (void)
+{
+	msg ("%24d worker tasks", pools * ntasks);
+	if (pools > 1)
+	{
+		msg ("%24d worker pools", pools);
+	}
+	msg ("%24llu commands run by the workers", pool_cmds);
+	if (pool_capacity > 0.0)
+	{
+		msg ("%23.1f%% worker utilization", 100.0 * pool_busy / pool_capacity);
+	}
+	msg ("%24.3f seconds the scans waited for workers", pool_stalled);
+}
+
+/* Execute command for a pathname. */
+
+static void
+execute (int ntasks, char *command, char *path)
+{
+	char cs[COMMAND_LENGTH];
+	int status;
+
+	/* Skip when the path does not match regexp. */
+	if (regexp != NULL)
+	{
+		if (! rmatch (path))
+		{
+			return;
+		}
+	}
+
+	/* NOP when no command was specified. */
+	if (command != NULL)
+	{
+		build_command (cs, command, path);
+		if (ntasks > 0)
+		{
+			queue_command (work, cs);
+		}
+		else
+		{
+			status = do_command (cs);
+		}
+	}
+	else
+	{
+
+		/* No command specified. Also we should run only one
+		   task (garbled output). */
+		if (ntasks > 0 )
+		{
+			err (FAILURE, "Cannot multitask when no command was specified");
+		}
+
+		/* And just fail out anyway. */
+		err (FAILURE, "No command to execute");
+	}
+}
+
+/* Full pathname, with a transformed copy. */
+static char *pathname = NULL;
+static char *tpathname = NULL;
+
+/* Transformed directory name. */
+static char *tdirname = NULL;
+
+/* Process one directory row. */
+
+static void
+process_directory (long long unsigned coll_id, char *dirname)
+{
+
+	/* If there was a regexp match for directory. */
+	int dmatch;
+
+	(void) strcpy (dbc->last_path, dirname);
+
+	/* Transform path accordingly to regexp. */
+	dmatch = transformpath (tdirname, dirname);
+
+	/* Print transformed directory name when verbose. */
+	if (dmatch && verbose)
+	{
+		info ("%s", tdirname);
+	}
+
+	/* Print transformed name with file ID. */
+	/* Attention! This listing might be misleading showing
+	   IDs with names which are not the real names. */
+	if (dmatch && printid)
+	{
+
+		/* Print transformed name with id. */
+		info ("%24llu %s", coll_id, tdirname);
+	}
+
+	/* Execute command  for the directory with the
+	   transformed name when required. */
+	if (dmatch && (command != NULL))
+	{
+		execute (ntasks, command, tdirname);
+	}
+
+	/* Execute SQL statement with the transformed directory
+	   name when required. */
+	if (dmatch && (sqlstmt != NULL))
+	{
+		execute_sqlstmt (dbc->conn, sqlstmt, coll_id, tdirname);
+	}
+
+	/* When the name is too long. */
+	if (dmatch && (check_length > 0))
+	{
+
+		/* Length check required print the name if too long. */
+		if (strlen (dirname) > check_length)
+		{
+			info ("%s", dirname);
+		}
+	}
+}
+
+/* Ids of the objects seen for one replica of every object, open
+   addressing on a power of two table. A slot is used when it has the
+   current generation, a new generation empties the table. */
+typedef struct seen {
+	long long unsigned id;
+	unsigned generation;
+} seen_t;
+
+static seen_t *seen = NULL;
+static size_t seen_size = 0;
+static size_t seen_count = 0;
+static unsigned seen_generation = 1;
+
+/* Slot of an id, the slot with it or the free slot where it goes. */
+
+static seen_t *
+seen_slot (seen_t *table, size_t size, long long unsigned id)
+{
+	size_t i;
+
+	i = (size_t) ((id * 11400714819323198485ULL) >> 20) & (size - 1);
+	while (table[i].generation == seen_generation && table[i].id != id)
+	{
+		i = (i + 1) & (size - 1);
+	}
+	return (&table[i]);
+}
+
+/* Note the id of an object, returns if it is the first replica seen. */
+
+static int
+first_replica (long long unsigned id)
+{
+	seen_t *table;
+	seen_t *slot;
+	size_t size;
+	size_t i;
+
+	/* Double the table when it is half full. */
+	if (2 * (seen_count + 1) > seen_size)
+	{
+		size = seen_size > 0 ? 2 * seen_size : 4096;
+		table = (seen_t *) allocate (size * sizeof (seen_t));
+		memset (table, 0, size * sizeof (seen_t));
+		for (i=0; i<seen_size; i++)
+		{
+			if (seen[i].generation == seen_generation)
+			{
+				*seen_slot (table, size, seen[i].id) = seen[i];
+			}
+		}
+		free (seen);
+		seen = table;
+		seen_size = size;
+	}
+	slot = seen_slot (seen, seen_size, id);
+	if (slot->generation == seen_generation)
+	{
+		return (false);
+	}
+	slot->id = id;
+	slot->generation = seen_generation;
+	seen_count++;
+	return (true);
+}
+
+/* Forget the ids seen. The replicas of an object are in one collection,
+   so it is done for every collection to keep the table small. */
+
+static void
+forget_replicas (void)
+{
+	seen_count = 0;
+	seen_generation++;
+	if (seen_generation == 0)
+	{
+		memset (seen, 0, seen_size * sizeof (seen_t));
+		seen_generation = 1;
+	}
+}
+
+/* Changes processed while watching, an object replica or a collection,
+   which has replica number -1, with the time of the change, open
+   addressing on a power of two table. Every poll selects the changes of
+   the slack before it again, those in the table are left out. */
+typedef struct change {
+	long long unsigned id;
+	long long repl;
+	long long ts;
+	int used;
+} change_t;
+
+static change_t *changes = NULL;
+static size_t changes_size = 0;
+static size_t changes_count = 0;
+
+/* Slot of a change, the slot with it or the free slot where it goes. */
+
+static change_t *
+change_slot (change_t *table, size_t size, change_t *c)
+{
+	size_t i;
+
+	i = (size_t) (((c->id ^ (long long unsigned) c->ts) *
+		11400714819323198485ULL) >> 20) & (size - 1);
+	while (table[i].used && (table[i].id != c->id ||
+		table[i].repl != c->repl || table[i].ts != c->ts))
+	{
+		i = (i + 1) & (size - 1);
+	}
+	return (&table[i]);
+}
+
+/* Drop the changes no poll selects again, older than the watermark and
+   not new by id either, and make room for more. */
+
+static void
+forget_changes (void)
+{
+	change_t *table;
+	size_t size;
+	size_t n;
+	size_t i;
+
+	n = 0;
+	for (i=0; i<changes_size; i++)
+	{
+		if (changes[i].used && (changes[i].ts >= watermark ||
+			(changes[i].repl >= 0 && (long long) changes[i].id > watch_id)))
+		{
+			changes[n++] = changes[i];
+		}
+	}
+	size = 4096;
+	while (4 * (n + 1) > size)
+	{
+		size *= 2;
+	}
+	table = (change_t *) allocate (size * sizeof (change_t));
+	memset (table, 0, size * sizeof (change_t));
+	for (i=0; i<n; i++)
+	{
+		*change_slot (table, size, &changes[i]) = changes[i];
+	}
+	free (changes);
+	changes = table;
+	changes_size = size;
+	changes_count = n;
+}
+
+/* Note a change, returns if it was not processed before. */
+
+static int
+first_change (long long unsigned id, long long repl, long long ts)
+{
+	change_t c;
+	change_t *slot;
+
+	if (2 * (changes_count + 1) > changes_size)
+	{
+		forget_changes ();
+	}
+	c.id = id;
+	c.repl = repl;
+	c.ts = ts;
+	c.used = true;
+	slot = change_slot (changes, changes_size, &c);
+	if (slot->used)
+	{
+		return (false);
+	}
+	*slot = c;
+	changes_count++;
+	return (true);
+}
+
+/* Note the changes the first scan processes which the polls select
+   again. Selected before the scan, all of them are in its snapshot. */
 
 static void
-cleanup (void)
+note_changes (PGconn *conn)
 {
+	char *select_cmd;
+	char *changes_cmd;
 	PGresult *res;
+	int i;
 
-	/* Update end time. */
-	dbc->endtime = time (NULL);
-	if (dbc->endtime == (time_t) -1)
+	select_cmd = dirsonly ? directories_sql (0) : tree_sql (0);
+	changes_cmd = (char *) allocate (strlen (select_cmd) + 1024);
+	(void) sprintf (changes_cmd, "%s AND (%smodify_ts>='%011lld' OR \
+%screate_ts>='%011lld')", select_cmd, dirsonly ? "c." : "d.",
+		next_watermark, dirsonly ? "c." : "d.", next_watermark);
+	free (select_cmd);
+	if (debug > 5)
 	{
-		err (FAILURE, "Error getting end time");
+		msg ("%s", changes_cmd);
+	}
+	res = pcmd (conn, changes_cmd);
+	for (i=0; i<PQntuples (res); i++)
+	{
+		(void) first_change ((long long unsigned) atoll (PQgetvalue (res, i, 0)),
+			dirsonly ? -1 : atoll (PQgetvalue (res, i, 5)),
+			atoll (PQgetvalue (res, i, PQnfields (res) - 1)));
 	}
-
-	/* Roll back end finish. */
-	closecursor (dbc->hf);
-	closecursor (dbc->hd);
-	res = PQexec (dbc->conn, "ROLLBACK");
 	PQclear (res);
-	PQfinish (dbc->conn);
+	free (changes_cmd);
 }
 
-/* Signal handler. */
+/* Process one file row, file id (column data_id in r_data_main), size,
+   file name and the directory name of the file with their lengths. */
 
 static void
-signal_handler (int signo)
+process_file (long long unsigned fileid, long long unsigned filesize,
+	char *filename, int filename_len, char *dirname, int dirname_len)
 {
-	if (signo == SIGHUP || signo == SIGINT ||
-		signo == SIGQUIT || signo == SIGTERM)
+
+	/* If there was a regexp match for a file. */
+	int fmatch;
+
+	/* Depth of the file and a pointer to walk the directory name. */
+	int depth;
+	char *p;
+
+	/* Root of the file. */
+	root_t *root;
+
+
+	/* Another replica of the object was taken, it is not a file. */
+	if (replica_any && ! first_replica (fileid))
 	{
+		dbc->fno--;
+		dbc->dupno++;
+		return;
+	}
 
-		/* Interrupt received, cleanup and exit. */
-		(void) fprintf (stderr, "Interrupted, cleaning up and exiting\n");
-		(void) fprintf (stderr, "Last path was: '%s'\n", dbc->last_path);
-		(void) fprintf (stderr, "Last command was: '%s'\n", dbc->last_command);
-		cleanup ();
-		print_summary (dbc);
-		exit (FAILURE);
+	/* File info. */
+	if (((size_t) dirname_len + (size_t) filename_len + 2) >
+		PATHNAME_LENGTH)
+	{
+		err (FAILURE, "Pathname too long");
 	}
-	else
+	memcpy (pathname, dirname, (size_t) dirname_len);
+	pathname[dirname_len] = SLASH;
+	memcpy (pathname + dirname_len + 1, filename, (size_t) filename_len);
+	pathname[dirname_len + 1 + filename_len] = EOS;
+	memcpy (dbc->last_path, pathname,
+		(size_t) dirname_len + (size_t) filename_len + 2);
+
+	/* The part of the expression the database could not evaluate. */
+	if (expr_client != NULL)
 	{
-		(void) fprintf (stderr, "Interrupted, signal %d - confused\n", signo);
-		(void) fflush (stderr);
+		depth = 1 - root_slashes;
+		for (p = dirname; p < dirname + dirname_len; p++)
+		{
+			if (*p == SLASH)
+			{
+				depth++;
+			}
+		}
+		if (! expr_eval (expr_client, filesize,
+			pathname + dirname_len + 1, pathname, depth))
+		{
+			dbc->fno--;
+			return;
+		}
+	}
+	dbc->total += filesize;
+
+	/* Count the file for its root too. */
+	if (nroots > 1)
+	{
+		root = find_root (pathname, (size_t) dirname_len + 1);
+		if (root != NULL)
+		{
+			root->fno++;
+			root->total += filesize;
+		}
+	}
+
+	/* If the file name matches regexp. */
+	fmatch = transformpath (tpathname, pathname);
+
+	/* Print transformed name if matches and verbose. */
+	if (fmatch && verbose)
+	{
+		info ("%s", tpathname);
+	}
+
+	/* Print transformed name with ID. */
+	/* Attention! This listing might be misleading showing
+	   IDs with names which are not the real names. */
+	if (fmatch && printid)
+	{
+
+		/* Print transformed name with id. */
+		info ("%24llu %s", fileid, tpathname);
+	}
+
+	/* Check for UTF conformance. */
+	if (fmatch && (utf != NULL))
+	{
+		if (! is_utf (pathname))
+		{
+
+			/* Print non-conforming transformed path. */
+			msg ("%s", tpathname);
+
+			/* Execute command for malformed
+			   path if there is any. */
+			if (command != NULL)
+			{
+				execute (ntasks, command, tpathname);
+			}
+			dbc->nutfno++;
+		}
+	}
+
+	/* Execute command when required. */
+	if (fmatch && command != NULL)
+	{
+		execute (ntasks, command, tpathname);
+	}
+
+	/* SQL statement on transformed path. */
+	if (fmatch && sqlstmt != NULL)
+	{
+		execute_sqlstmt (dbc->conn, sqlstmt,
+			fileid, tpathname);
+	}
+
+	/* When the name is too long. */
+	if (fmatch && (check_length > 0))
+	{
+
+		/* Length check required, print the
+		   name if it is too long. */
+		if (strlen (pathname) > check_length)
+		{
+			info ("%s", tpathname);
+		}
 	}
+
+	/* Nothing was asked, nothing to do. */
 }
 
-/* Establish signal handler. */
+/* Process one file row of a fetch, row j in the file handle. */
 
 static void
-siga (int s, struct sigaction *sa)
+process_file_row (pghandle_t *h, int j, char *dirname, int dirname_len)
 {
-	int status;
 
-	sa->sa_handler = signal_handler;
-	status = sigemptyset (&sa->sa_mask);
-	if (status == -1)
+	/* File name. */
+	char *filename;
+
+	/* File size. */
+	long long unsigned filesize;
+
+	/* File id (column dat_id in r_data_main). */
+	long long unsigned fileid;
+
+	/* File name. */
+	filename = PQgetvalue(h->res, j, 2);
+	if (filename == NULL)
 	{
-		err (FAILURE, "Error calling sigemptyset - confused");
+		err (FAILURE,
+			"Function PQgetvalue returned NULL - confused");
 	}
-	sa->sa_flags = 0;
-	status = sigaction (s, sa, NULL);
-	if (status == -1)
+
+	/* File size. */
+	filesize = value_id (PQgetvalue(h->res, j, 1),
+		PQgetlength(h->res, j, 1), h->format);
+
+	/* File id. */
+	fileid = value_id (PQgetvalue(h->res, j, 0),
+		PQgetlength(h->res, j, 0), h->format);
+
+	/* Watching, the change was processed by an earlier poll. */
+	if (watch_seconds > 0 && h->nfields > 6 && ! first_change (fileid,
+		(long long) value_id (PQgetvalue(h->res, j, 5),
+			PQgetlength(h->res, j, 5), h->format),
+		(long long) value_id (PQgetvalue(h->res, j, 6),
+			PQgetlength(h->res, j, 6), h->format)))
 	{
-		err (FAILURE, "Error calling sigaction - confused");
+		dbc->fno--;
+		return;
 	}
+	process_file (fileid, filesize, filename, PQgetlength(h->res, j, 2),
+		dirname, dirname_len);
 }
 
-/* Build the command using command string and pathname. */
+/* Counters a scan process reports back. */
+typedef struct partcount {
+
+	/* Root of the files and total, -1 for all the counters. */
+	int root;
+
+	/* Number of records, directories and files seen. */
+	long long unsigned rno;
+	long long unsigned dno;
+	long long unsigned fno;
+
+	/* Not UTF counted. */
+	long long unsigned nutfno;
+
+	/* Replicas left out. */
+	long long unsigned dupno;
+
+	/* Number of fetches. */
+	long long unsigned fetches;
+
+	/* Total size. */
+	long long unsigned total;
+
+	/* Number of SQL statements executed and failed, and their rows. */
+	long unsigned nsqlstmt;
+	long unsigned nsqlfailed;
+	long long unsigned nsqlrows;
+
+	/* Seconds spent waiting for the database. */
+	double dbwait;
+
+	/* Fetches by kind and size. */
+	long long unsigned fetch_sizes[2][FETCH_BUCKETS];
+
+	/* Statements by kind. */
+	stat_t stats[STAT_KINDS];
+
+	/* Worker pools and their use. */
+	int pools;
+	long long unsigned pool_cmds;
+	double pool_busy;
+	double pool_capacity;
+	double pool_stalled;
+} partcount_t;
+
+/* Ids of the collections to split, sorted. */
+static long long unsigned *giants = NULL;
+static int ngiants = 0;
+
+/* Set up a forked scan process. The connections of the parent are not
+   ours to use, the main connection is a new one reading the snapshot.
+   It also runs the -Q statements, so it is not read only. */
 
 static void
-build_command (char *cmd, char *cmds, char *pathname)
+start_child_scan (void)
 {
-	char *s;
-	char *state;
-	char *token;
-	int formats;
+	int i;
 
-	/* Null command string. */
-	if (cmds == NULL)
+	dbc->rno = (long long unsigned) 0;
+	dbc->dno = (long long unsigned) 0;
+	dbc->fno = (long long unsigned) 0;
+	dbc->nutfno = (long long unsigned) 0;
+	dbc->dupno = (long long unsigned) 0;
+	dbc->fetches = (long long unsigned) 0;
+	dbc->total = (long long unsigned) 0;
+	nsqlstmt = 0;
+	nsqlfailed = 0;
+	nsqlrows = 0;
+	nbatch_ids = 0;
+	dbwait = 0.0;
+	memset (fetch_sizes, 0, sizeof (fetch_sizes));
+	memset (stats, 0, sizeof (stats));
+	for (i=0; i<nroots; i++)
 	{
-		err (FAILURE, "Command string is null");
+		roots[i].fno = (long long unsigned) 0;
+		roots[i].total = (long long unsigned) 0;
+	}
+	dbc->hd = NULL;
+	dbc->hf = NULL;
+	splits = NULL;
+	splits_tail = &splits;
+
+	/* The write connection of the parent is not ours either. */
+	forget_write_connection ();
+	dbc->conn = open_scan_connection (dbc->snapshot, false);
+	if (sqlprepared != NULL && ! test && write_group == 0)
+	{
+		prepare (dbc->conn, SQLSTMT_NAME, sqlprepared, SQLSTMT_TYPE);
 	}
+	open_scans (dbc->snapshot);
 
-	/* Check. */
-	if (strlen (cmds) == (size_t) 0)
+	/* Nor the workers, the commands go to workers of our own. Their
+	   use is reported with the counters. */
+	if (ntasks > 0)
 	{
-		err (FAILURE, "Empty command string in build_command");
+		if (work != NULL)
+		{
+			leave_work (work);
+		}
+		work = create_work (ntasks, work_slots);
+		pools = 0;
+		pool_cmds = (long long unsigned) 0;
+		pool_busy = 0.0;
+		pool_capacity = 0.0;
+		pool_stalled = 0.0;
 	}
-	if (index (pathname, 0x027) != NULL)
+}
+
+/* Finish a forked scan process, report the counters on the file
+   descriptor and exit. */
+
+static void
+end_child_scan (int fd)
+{
+	partcount_t c;
+	PGresult *res;
+	ssize_t written;
+	int i;
+
+	if (ntasks > 0)
 	{
-		err (FAILURE, "Single quote detected in %s", pathname);
+		finish_work (work);
+		count_work (work);
 	}
+	flush_sqlbatch (dbc->conn);
+	close_write_connection ();
+	close_scans ();
+	res = pcmd (dbc->conn, "END");
+	PQclear (res);
+	PQfinish (dbc->conn);
 
-	/* Enter command function. */
-	if (debug > 10)
+	/* One write smaller than PIPE_BUF, it is not mixed with the others,
+	   then one for every root with files. */
+	c.root = -1;
+	c.rno = dbc->rno;
+	c.dno = dbc->dno;
+	c.fno = dbc->fno;
+	c.nutfno = dbc->nutfno;
+	c.dupno = dbc->dupno;
+	c.fetches = dbc->fetches;
+	c.total = dbc->total;
+	c.nsqlstmt = nsqlstmt;
+	c.nsqlfailed = nsqlfailed;
+	c.nsqlrows = nsqlrows;
+	c.dbwait = dbwait;
+	memcpy (c.fetch_sizes, fetch_sizes, sizeof (fetch_sizes));
+	memcpy (c.stats, stats, sizeof (stats));
+	c.pools = pools;
+	c.pool_cmds = pool_cmds;
+	c.pool_busy = pool_busy;
+	c.pool_capacity = pool_capacity;
+	c.pool_stalled = pool_stalled;
+	written = write (fd, &c, sizeof (c));
+	if (written != (ssize_t) sizeof (c))
 	{
-		msg ("Build command '%s' '%s'", cmds, pathname);
+		err (FAILURE, "Cannot report counters of the scan process");
+	}
+	memset (&c, 0, sizeof (c));
+	for (i=0; i<nroots; i++)
+	{
+		if (roots[i].fno > 0)
+		{
+			c.root = i;
+			c.fno = roots[i].fno;
+			c.total = roots[i].total;
+			written = write (fd, &c, sizeof (c));
+			if (written != (ssize_t) sizeof (c))
+			{
+				err (FAILURE, "Cannot report counters of the scan process");
+			}
+		}
 	}
+	exit (SUCCESS);
+}
 
-	/* Count format items (starting with %). */
-	s = strdup (cmds);
-	if (s == NULL)
+/* Fork a scan process, returns the pid, 0 in the child. */
+
+static pid_t
+fork_child_scan (int fds[2])
+{
+	pid_t pid;
+
+	pid = fork ();
+	if (pid < (pid_t) 0)
 	{
-		err (FAILURE, "Function strdup failed in build_command");
+		err (FAILURE, "Cannot fork scan process: %s", strerror (errno));
 	}
-	state = s;
-	formats = 0;
-	token = strsep (&state, "%");
-	while (token != NULL)
+	if (pid == (pid_t) 0)
 	{
-		formats++;
-		token = strsep (&state, "%");
+		(void) close (fds[0]);
+		start_child_scan ();
 	}
-	formats--;
-	if (formats < 0)
+	return (pid);
+}
+
+/* Open the pipe for the counters of the scan processes. Output
+   buffered before should not be written twice. The commands queued stay
+   with the workers of this process. */
+
+static void
+open_child_scans (int fds[2])
+{
+	if (pipe (fds) == -1)
 	{
-		err (FAILURE, "Wrong formats in build_command - confused");
+		err (FAILURE, "Cannot create pipe for scan processes: %s",
+			strerror (errno));
 	}
-	if (formats > 4)
+
+	/* The commands run do not keep the pipe open after the scans. */
+	(void) fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+	(void) fflush (NULL);
+}
+
+/* Add the counters of a scan process. */
+
+static void
+count_child_scan (partcount_t *c)
+{
+	int i;
+	int j;
+
+	dbc->rno += c->rno;
+	dbc->dno += c->dno;
+	dbc->fno += c->fno;
+	dbc->nutfno += c->nutfno;
+	dbc->dupno += c->dupno;
+	dbc->fetches += c->fetches;
+	dbc->total += c->total;
+	nsqlstmt += c->nsqlstmt;
+	nsqlfailed += c->nsqlfailed;
+	nsqlrows += c->nsqlrows;
+	dbwait += c->dbwait;
+	pools += c->pools;
+	pool_cmds += c->pool_cmds;
+	pool_busy += c->pool_busy;
+	pool_capacity += c->pool_capacity;
+	pool_stalled += c->pool_stalled;
+	for (i=0; i<FETCH_BUCKETS; i++)
 	{
-		err (FAILURE, "Too many formats in build_command");
+		for (j=0; j<2; j++)
+		{
+			fetch_sizes[j][i] += c->fetch_sizes[j][i];
+		}
 	}
-	free (s);
+	for (i=0; i<STAT_KINDS; i++)
+	{
+		stats[i].n += c->stats[i].n;
+		stats[i].rows += c->stats[i].rows;
+		stats[i].bytes += c->stats[i].bytes;
+		stats[i].time += c->stats[i].time;
+		if (c->stats[i].max > stats[i].max)
+		{
+			stats[i].max = c->stats[i].max;
+		}
+		for (j=0; j<STAT_BUCKETS; j++)
+		{
+			stats[i].latency[j] += c->stats[i].latency[j];
+		}
+	}
+}
 
-	/* Build command. */
-	if ((strlen (cmds) + formats * (strlen (pathname) + 2) + 3) >
-		COMMAND_LENGTH)
+/* Wait for n scan processes and add up their counters. Returns the
+   number of files they saw. */
+
+static long long unsigned
+wait_child_scans (int fds[2], int n)
+{
+	int i;
+	int failed;
+	int reported;
+	int wait_status;
+	pid_t pid;
+	partcount_t c;
+	ssize_t nread;
+	long long unsigned files;
+
+	(void) close (fds[1]);
+
+	/* Add up the counters until all of them closed the pipe, the counters
+	   of many roots may not fit in it. */
+	reported = 0;
+	files = (long long unsigned) 0;
+	nread = read (fds[0], &c, sizeof (c));
+	while (nread == (ssize_t) sizeof (c) || (nread < 0 && errno == EINTR))
 	{
-		err (FAILURE, "Strings too long for command");
+		if (nread < 0)
+		{
+			;
+		}
+		else if (c.root >= 0)
+		{
+			roots[c.root].fno += c.fno;
+			roots[c.root].total += c.total;
+		}
+		else
+		{
+			count_child_scan (&c);
+			files += c.fno;
+			reported++;
+		}
+		nread = read (fds[0], &c, sizeof (c));
 	}
-	switch (formats)
+	(void) close (fds[0]);
+
+	/* Wait for all of them. */
+	failed = 0;
+	for (i=0; i<n; i++)
 	{
-	case 0:
-		(void) strcpy (cmd, cmds);
-		(void) strcat (cmd, " ");
-		(void) strcat (cmd, "'");
-		(void) strcat (cmd, pathname);
-		(void) strcat (cmd, "'");
-		break;
-	case 1:
-		(void) sprintf (cmd, cmds, pathname);
-		break;
-	case 2:
-		(void) sprintf (cmd, cmds, pathname, pathname);
-		break;
-	case 3:
-		(void) sprintf (cmd, cmds, pathname, pathname, pathname);
-		break;
-	case 4:
-		(void) sprintf (cmd, cmds, pathname, pathname, pathname, pathname);
-		break;
-	default:
-		err (FAILURE, "Bad formats in build_command - confused");
-		break;
+		pid = wait (&wait_status);
+		if (pid < 0)
+		{
+			err (FAILURE, "Error waiting");
+		}
+
+		/* A worker interrupted is not a scan process. */
+		if (is_worker (work, pid))
+		{
+			i--;
+			continue;
+		}
+		if (! WIFEXITED (wait_status) || WEXITSTATUS (wait_status) != 0)
+		{
+			failed++;
+		}
 	}
+	if (failed > 0 || reported != n)
+	{
+		err (FAILURE, "Scan failed in %d of %d processes",
+			failed > n - reported ? failed : n - reported, n);
+	}
+	return (files);
 }
 
-/* Run command with retry. */
+/* Compare ids for qsort and bsearch. */
 
-int
-run_command (int retries, int period, char *cmd)
+static int
+compare_id (const void *a, const void *b)
 {
-	int status;
-	int nretries;
-	int unslept;
+	long long unsigned x;
+	long long unsigned y;
 
-	if (retries <= 0)
-	{
+	x = *(const long long unsigned *) a;
+	y = *(const long long unsigned *) b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
 
-		/* Won't retry. Fail out when there was an error. */
-		status = system (cmd);
-		if (status == -1)
-		{
+/* Find the collections with more files than the split size. Counting
+   the files of every collection would cost a scan of r_data_main, the
+   planner statistics have the most common collection ids with their
+   frequency, and the giant collections are the most common ones. */
 
-			/* The system library function failed. */
-			err (FAILURE, "There was a system error running '%s'", cmd);
-		}
-		else
+static void
+find_giants (PGconn *conn)
+{
+	char *giants_select;
+	char *giants_cmd;
+	PGresult *res;
+	int i;
+
+	giants_select = "SELECT m.v,m.f*c.reltuples \
+FROM pg_class c JOIN pg_stats s \
+ON s.schemaname=c.relnamespace::regnamespace::text AND s.tablename=c.relname, \
+unnest(s.most_common_vals::text::bigint[],s.most_common_freqs) m(v,f) \
+WHERE c.oid='r_data_main'::regclass AND s.attname='coll_id' \
+AND m.f*c.reltuples>=%llu ORDER BY m.v";
+	giants_cmd = (char *) allocate (strlen (giants_select) + 1024);
+	(void) sprintf (giants_cmd, giants_select, split_size);
+	res = pcmd (conn, giants_cmd);
+	free (giants_cmd);
+	ngiants = PQntuples (res);
+	giants = (long long unsigned *) allocate ((ngiants + 1) *
+		sizeof (long long unsigned));
+	for (i=0; i<ngiants; i++)
+	{
+		giants[i] = (long long unsigned) atoll (PQgetvalue (res, i, 0));
+		if (debug > 5)
 		{
-			if (status != 0)
-			{
+			msg ("Collection id %llu has about %s files, will be split",
+				giants[i], PQgetvalue (res, i, 1));
+		}
+	}
+	PQclear (res);
+	qsort (giants, (size_t) ngiants, sizeof (long long unsigned), compare_id);
+}
 
-				/* Non-zero returned from the command.
-				   Don't quit when forced. */
-				if (! force)
-				{
+/* Is the collection to be split. */
 
-					/* Abort will never return. */
-					err (FAILURE, "Error %d running '%s'", status, cmd);
-				}
-				return (status);
-			}
-			else
-			{
+static int
+is_giant (long long unsigned coll_id)
+{
+	return (ngiants > 0 && bsearch (&coll_id, giants, (size_t) ngiants,
+		sizeof (long long unsigned), compare_id) != NULL);
+}
 
-				/* No error, status is 0, finish here. */
-				return (0);
-			}
-		}
-	}
-	else
+/* Scan the files of a giant collection in split_ranges processes, each
+   reading a data_id range on its own connection. */
+
+static void
+split_collection (long long unsigned coll_id, char *dirname,
+	int dirname_len, int batchsize)
+{
+	char *range_select;
+	char *range_cmd;
+	char *files_cmd;
+	PGresult *res;
+	long long unsigned lo;
+	long long unsigned hi;
+	long long unsigned step;
+	int fds[2];
+	int i;
+	int j;
+	pghandle_t *h;
+	split_t *sp;
+	double t;
+
+	/* The id range of the files. The bounds only split the work, the
+	   first and last ranges are open so nothing is missed if the
+	   collection changed since the snapshot. */
+	range_select = "SELECT coalesce(min(data_id),0),coalesce(max(data_id),0) \
+FROM r_data_main WHERE coll_id=%llu";
+	range_cmd = (char *) allocate (strlen (range_select) + 1024);
+	(void) sprintf (range_cmd, range_select, coll_id);
+	res = pcmd (dbc->conn, range_cmd);
+	lo = (long long unsigned) atoll (PQgetvalue (res, 0, 0));
+	hi = (long long unsigned) atoll (PQgetvalue (res, 0, 1));
+	PQclear (res);
+	step = (hi - lo) / (long long unsigned) split_ranges + 1;
+	if (debug > 5)
 	{
+		msg ("Splitting %s, ids %llu to %llu in %d ranges", dirname, lo, hi,
+			split_ranges);
+	}
 
-		/* Retry, there was an error. */
-		nretries = retries;
-		while (nretries > 0 && status != 0)
+	/* Fork the range scans. */
+	t = clock_seconds ();
+	open_child_scans (fds);
+	for (i=0; i<split_ranges; i++)
+	{
+		if (fork_child_scan (fds) == (pid_t) 0)
 		{
 
-			/* Wait. */
-			unslept = sleep (period);
-			if (unslept != 0)
+			/* Child, the files select with the range added. */
+			files_cmd = files_sql (0);
+			range_cmd = (char *) allocate (strlen (files_cmd) + 1024);
+			(void) strcpy (range_cmd, files_cmd);
+			if (i > 0)
 			{
-				err (FAILURE, "There was an error sleeping for '%s'", cmd);
+				(void) sprintf (range_cmd + strlen (range_cmd),
+					" AND data_id>=%llu", lo + i * step);
 			}
-
-			/* Retry. */
-			status = system (cmd);
-			if (status == -1)
+			if (i < split_ranges - 1)
 			{
-				err (FAILURE, "There was a system error running '%s'", cmd);
+				(void) sprintf (range_cmd + strlen (range_cmd),
+					" AND data_id<%llu", lo + (i + 1) * step);
 			}
-			else
+			free (files_cmd);
+			h = prepare_cursor (dbc->fconn, "s", batchsize, range_cmd);
+			free (range_cmd);
+			dbc->hf = h;
+			open_cursor (h, coll_id);
+			fetch (h);
+			dbc->fetches++;
+			dbc->rno += (long long unsigned) h->nrows;
+			dbc->fno += (long long unsigned) h->nrows;
+			while (h->nrows > 0)
 			{
-				if (status != 0)
+				for (j=0; j<(h->nrows); j++)
 				{
-
-					/* Non-zero returned from the command. */
-					msg ("Error %d retrying '%s'", status, cmd);
-					if (retry_failures >= max_retry_failures)
-					{
-
-						/* Reached the limit. */
-						err (FAILURE,
-							"There were more than %d command retries - abort",
-							max_retry_failures);
-					}
-					retry_failures++;
+					process_file_row (h, j, dirname, dirname_len);
 				}
-
-				/* We got zero status. */
-				return (0);
+				fetch (h);
+				dbc->fetches++;
+				dbc->rno += (long long unsigned) h->nrows;
+				dbc->fno += (long long unsigned) h->nrows;
+				show_progress (dbc->fetches);
 			}
+			closecursor (h);
+			dbc->hf = NULL;
+			end_child_scan (fds[1]);
 		}
-
-		/* Still failing after so many retries. */
-		msg ("Command '%s' still failing after %d retries", cmd, retries);
 	}
 
-	/* Finish, with or without retries with the status of the last run. */
-	return (status);
+	/* Note it for the summary. */
+	sp = new (split_t);
+	sp->name = strdup (dirname);
+	if (sp->name == NULL)
+	{
+		err (FAILURE, "Function strdup failed");
+	}
+	sp->files = wait_child_scans (fds, split_ranges);
+	sp->seconds = clock_seconds () - t;
+	sp->next = NULL;
+	*splits_tail = sp;
+	splits_tail = &sp->next;
 }
 
-/* Do command. */
+/* Count the tree in the database, for the summary only. The unique
+   sort types count a file name in a collection once. */
 
-static int
-do_command (char *cmd)
+static void
+count_tree (int sort)
 {
-	int status;
+	char *tree_cmd;
+	char *count_select;
+	char *count_cmd;
+	char *root_case;
+	PGresult *res;
+	int i;
+	int n;
+	double t;
 
-	if (strlen (cmd) == 0)
+	dbc->dno = count_directories (dbc->conn);
+	dbc->rno = dbc->dno;
+	if (dirsonly)
 	{
-		err (FAILURE, "Command is the empty string", cmd);
+		return;
 	}
-	if (debug > 10)
+	tree_cmd = tree_sql ((sort == 3 || sort == 4) ? 3 : 0);
+
+	/* With several roots count each of them. */
+	root_case = (char *) allocate (roots_size + 1024);
+	if (nroots > 1)
 	{
-		msg ("Running command '%s'", cmd);
+		count_select = "SELECT count(*),coalesce(sum(f.data_size),0),%s \
+FROM (%s) f GROUP BY 3";
+		(void) root_case_sql (root_case, "f.coll_name");
 	}
-	if (test)
+	else
 	{
-		msg ("%s", cmd);
+		count_select = "SELECT count(*),coalesce(sum(f.data_size),0)%s \
+FROM (%s) f";
+		*root_case = EOS;
 	}
-	else
+	count_cmd = (char *) allocate (strlen (count_select) +
+		strlen (root_case) + strlen (tree_cmd) + 1);
+	(void) sprintf (count_cmd, count_select, root_case, tree_cmd);
+	free (root_case);
+	free (tree_cmd);
+	if (debug > 5)
 	{
-
-		/* Take a note. */
-		(void) strncpy (dbc->last_command, cmd, COMMAND_LENGTH);
-
-		/* Run the command with shell. */
-		if (retry)
-		{
-
-			/* Retry three times after waiting for 59 seconds. */
-			status = run_command (3, 59, cmd);
-		}
-		else
-		{
-			status = run_command (0, 0, cmd);
-		}
-		if (status == -1)
+		msg ("%s", count_cmd);
+		explain (dbc->conn, count_cmd, 0, NULL);
+	}
+	capture_plan (dbc->conn, count_cmd, 0, NULL);
+	t = clock_seconds ();
+	res = pcmd (dbc->conn, count_cmd);
+	count_stat (STAT_QUERY, clock_seconds () - t, res);
+	n = PQntuples (res);
+	for (i = 0; i < n; i++)
+	{
+		dbc->fno += (long long unsigned) atoll (PQgetvalue (res, i, 0));
+		dbc->total += (long long unsigned) atoll (PQgetvalue (res, i, 1));
+		if (nroots > 1 && ! PQgetisnull (res, i, 2))
 		{
-			err (FAILURE, "There was an error running '%s'", cmd);
+			roots[atoi (PQgetvalue (res, i, 2))].fno =
+				(long long unsigned) atoll (PQgetvalue (res, i, 0));
+			roots[atoi (PQgetvalue (res, i, 2))].total =
+				(long long unsigned) atoll (PQgetvalue (res, i, 1));
 		}
-		if (status != 0)
-		{
-			if (! force)
-			{
-				(void) fprintf (stderr, "Command failed, status %d\n", status);
-				(void) fprintf (stderr, "Command was: '%s'\n", cmd);
-				(void) fflush (stderr);
-				cleanup ();
-				print_summary (dbc);
-				err (FAILURE, "Command returned nonzero status %d", status);
-			}
-			else
-			{
+	}
+	dbc->rno += dbc->fno;
+	PQclear (res);
+	free (count_cmd);
+}
 
-				/* Call system ignores SIGINT and SIGQUIT so
-				   extra magic needed. */
-				if (WIFSIGNALED (status))
-				{
-					if (WTERMSIG (status) == SIGHUP ||
-						WTERMSIG (status) == SIGINT ||
-						WTERMSIG (status) == SIGQUIT ||
-						WTERMSIG (status) == SIGTERM)
-					{
+/* Planner estimate of the rows of a select. */
 
-						/* There was an interrupt. */
-						msg ("Interrupted %s", cmd);
-						cleanup ();
-						print_summary (dbc);
-						err (FAILURE, "Interrupted with %d", status);
-					}
-				}
-				else
-				{
-					(void) fprintf (stderr, "Error %d for '%s'\n", status, cmd);
-					(void) fflush (stderr);
-				}
-			}
-		}
+static long long unsigned
+planner_rows (PGconn *conn, char *select)
+{
+	char *explain_select;
+	char *explain_cmd;
+	PGresult *res;
+	char *p;
+	long long unsigned r;
+
+	explain_select = "EXPLAIN %s";
+	explain_cmd = (char *) allocate (strlen (explain_select) +
+		strlen (select) + 1);
+	(void) sprintf (explain_cmd, explain_select, select);
+	res = pcmd (conn, explain_cmd);
+	free (explain_cmd);
+
+	/* The top node is the first line, ... rows=n width=w). */
+	r = (long long unsigned) 0;
+	p = strstr (PQgetvalue (res, 0, 0), " rows=");
+	if (p != NULL)
+	{
+		r = (long long unsigned) atoll (p + 6);
 	}
-	return (status);
+	PQclear (res);
+	return (r);
 }
 
-/* Execute function in parallel. */
+/* Least sampled files the sample is scaled up from, with fewer the
+   planner estimate is used. */
+#define PREFLIGHT_SAMPLE ((long long unsigned) 100)
+
+/* Estimate the tree before the scan: count the directories, which only
+   walks the collections, and sample the data pages for the files and
+   bytes. A small tree may have too few files in the sample, then the
+   number of files is the planner estimate and the bytes are from the
+   average size in the sample. */
 
 static void
-parallel (work_t *w, int (*f)(work_t *w, int taskid))
+preflight (void)
 {
-	task_t **tasks;
-	int n;
-	int i;
-	pid_t pid;
-	pid_t cpid;
-	int cstatus;
-	int exited;
-	int wait_pid;
-	int wait_status;
-
-	/* Get work data. */
-	tasks = w->tasks;
-	n = w->ntasks;
-
-	/* Check. */
-	if (n > MAX_TASKS || n <= 0)
+	char *colls;
+	char *filter;
+	char *sample_cmd;
+	char *tree_cmd;
+	char *size;
+	PGresult *res;
+	double t;
+	long long unsigned dirs;
+	long long unsigned files;
+	long long unsigned bytes;
+	long long unsigned sampled;
+	long long unsigned sampled_bytes;
+
+	t = clock_seconds ();
+	dirs = count_directories (dbc->conn);
+	sampled = (long long unsigned) 0;
+	sampled_bytes = (long long unsigned) 0;
+	if (preflight_percent > 0.0)
 	{
-		err (FAILURE, "Wrong number of tasks (%d), should be 0 < n <= %d",
-			n, MAX_TASKS);
+		colls = colls_sql ();
+		filter = tree_filter_sql ();
+		sample_cmd = (char *) allocate (strlen (colls) + strlen (filter) +
+			1024);
+		(void) sprintf (sample_cmd, "SELECT count(*),\
+coalesce(sum(d.data_size),0) FROM %s c,r_data_main d TABLESAMPLE SYSTEM (%g) \
+WHERE d.coll_id=c.coll_id%s", colls, preflight_percent, filter);
+		free (colls);
+		free (filter);
+		if (debug > 5)
+		{
+			msg ("%s", sample_cmd);
+		}
+		res = pcmd (dbc->conn, sample_cmd);
+		sampled = (long long unsigned) atoll (PQgetvalue (res, 0, 0));
+		sampled_bytes = (long long unsigned) atoll (PQgetvalue (res, 0, 1));
+		PQclear (res);
+		free (sample_cmd);
 	}
-
-	/* Fork n subprocesses. */
-	for (i=0; i<n; i++)
+	if (sampled >= PREFLIGHT_SAMPLE)
 	{
-		pid = fork ();
-		if (pid < (pid_t) 0)
-		{
+		files = (long long unsigned) ((double) sampled * 100.0 /
+			preflight_percent);
+		bytes = (long long unsigned) ((double) sampled_bytes * 100.0 /
+			preflight_percent);
+	}
+	else
+	{
+		tree_cmd = tree_sql (0);
+		files = planner_rows (dbc->conn, tree_cmd);
+		free (tree_cmd);
+		bytes = sampled > 0 ? files * (sampled_bytes / sampled) : 0;
+	}
+	msg ("%24llu directories", dirs);
+	msg ("%24llu files estimated %s", files,
+		sampled >= PREFLIGHT_SAMPLE ? "from the sample" : "by the planner");
+	size = printsize (bytes);
+	msg ("%24s estimated total%s", size, sampled > 0 ? "" : ", no sample");
+	free (size);
+	msg ("%24.3f seconds preflight", clock_seconds () - t);
+	estimate_rows = dirsonly ? dirs : files;
+}
 
-			/* Detailed reporting. */
-			(void) fprintf (stderr, "Forking %d tasks\n", n);
-			(void) fprintf (stderr, "Fork failed with %d\n", (int) pid);
-			(void) fprintf (stderr, "Corresponds to: '%s'\n", strerror (errno));
-			(void) fflush (stderr);
-			err (FAILURE, "Cannot fork task %d", i);
-		}
-		if (pid == (pid_t) 0)
-		{
-			/* Child. */
-			cpid = getpid ();
-			tasks[i]->pid = cpid;
+/* Largest batch size picked from the estimate. */
+#define PREFLIGHT_BATCH ((int) 16384)
+
+/* Files per worker task when the number of tasks is picked. */
+#define PREFLIGHT_TASK_FILES ((long long unsigned) 100000)
+
+/* Pick the batch size and the number of tasks from the estimate when
+   they were not given. About a thousand fetches for the tree, no fewer
+   rows than the default. Tasks for the commands, one per enough files,
+   no more than the processors. */
 
-			/* Run the function. */
-			cstatus = f (w, i);
+static void
+preflight_defaults (int *batchsize, int batchsize_given)
+{
+	long long unsigned n;
+	long cpus;
 
-			/* Exit child. */
-			exit (cstatus);
+	if (! batchsize_given)
+	{
+		n = estimate_rows / 1000;
+		if (n > (long long unsigned) PREFLIGHT_BATCH)
+		{
+			n = (long long unsigned) PREFLIGHT_BATCH;
 		}
-		else
+		if (n > (long long unsigned) *batchsize)
 		{
-
-			/* Parent. */
-			;
+			*batchsize = (int) n;
+			msg ("Batch size %d for the estimate", *batchsize);
 		}
 	}
-
-	/* Wait for all of them to exit. */
-	exited = 0;
-	while (exited < n)
+	if (command != NULL && ntasks == 0)
 	{
-		wait_pid = wait (&wait_status);
-		if (wait_pid < 0)
+		n = estimate_rows / PREFLIGHT_TASK_FILES;
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		if (cpus > 0 && n > (long long unsigned) cpus)
 		{
-			err (FAILURE, "Error waiting");
+			n = (long long unsigned) cpus;
+		}
+		if (n > (long long unsigned) MAX_TASKS)
+		{
+			n = (long long unsigned) MAX_TASKS;
+		}
+		if (n > 1)
+		{
+			ntasks = (int) n;
+			msg ("%d worker tasks for the estimate", ntasks);
 		}
-		exited++;
 	}
 }
 
-/* Run the queue. */
+/* Build the usage report select, the objects, bytes and replicas of
+   the tree grouped by resource, owner and collection at the report depth
+   below the root. A collection above that depth stands for itself. */
 
-static int
-run_queue (work_t *w, int taskid)
+static char *
+report_sql (void)
 {
-	task_t *t;
-	int i;
+	char *colls;
+	char *filter;
+	char *r;
 	int n;
-	int status;
 
-	/* Taskid is the same as the index. */
-	t = w->tasks[taskid];
+	/* Number of name parts up to the depth, the first is empty. */
+	count_root_slashes (true, "the usage report");
+	n = report_depth + 1 + root_slashes;
+	colls = colls_sql ();
+	filter = tree_filter_sql ();
+	r = (char *) allocate (strlen (colls) + strlen (filter) + 1024);
+	(void) sprintf (r, "SELECT d.resc_name,d.data_owner_name,\
+array_to_string((string_to_array(c.coll_name,'/'))[1:%d],'/'),\
+count(DISTINCT d.data_id),coalesce(sum(d.data_size),0),count(*) \
+FROM %s c,r_data_main d WHERE d.coll_id=c.coll_id%s \
+GROUP BY 1,2,3 ORDER BY 1,2,3", n, colls, filter);
+	free (colls);
+	free (filter);
+	return (r);
+}
 
-	/* Process the task. */
-	status = 0;
-	n = t->nextcmd;
-	if (n < 0)
-	{
+/* Print a CSV field, quoted when it has a comma, quote or line end. */
 
-		/* This in fact means that nextcmd was 0 at this point, i.e. no task. */
-		if (debug > 5)
+static void
+print_csv (char *s, char *end)
+{
+	char *p;
+
+	if (strpbrk (s, ",\"\r\n") == NULL)
+	{
+		(void) printf ("%s%s", s, end);
+		return;
+	}
+	(void) putchar ('"');
+	for (p = s; *p != EOS; p++)
+	{
+		if (*p == '"')
 		{
-			msg ("Running the queue as task %d, no cmds", taskid);
+			(void) putchar ('"');
 		}
+		(void) putchar (*p);
+	}
+	(void) printf ("\"%s", end);
+}
+
+/* Print the usage report of the tree, counted in the database in one
+   query. The totals go to the summary, the replicas as the files. */
+
+static void
+report_tree (void)
+{
+	char *report_cmd;
+	PGresult *res;
+	int n;
+	int i;
+	double t;
+
+	report_cmd = report_sql ();
+	if (debug > 5)
+	{
+		msg ("%s", report_cmd);
+		explain (dbc->conn, report_cmd, 0, NULL);
+	}
+	capture_plan (dbc->conn, report_cmd, 0, NULL);
+	t = clock_seconds ();
+	res = pcmd (dbc->conn, report_cmd);
+	count_stat (STAT_QUERY, clock_seconds () - t, res);
+	free (report_cmd);
+	n = PQntuples (res);
+	if (report_csv)
+	{
+		(void) printf ("resource,owner,collection,objects,bytes,replicas\n");
 	}
 	else
 	{
-		if (debug > 5)
+		(void) printf ("%-16s %-16s %12s %20s %10s %s\n", "resource",
+			"owner", "objects", "bytes", "replicas", "collection");
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (report_csv)
 		{
-			msg ("Running the queue as task %d, %d cmds", taskid, n);
+			print_csv (PQgetvalue (res, i, 0), ",");
+			print_csv (PQgetvalue (res, i, 1), ",");
+			print_csv (PQgetvalue (res, i, 2), ",");
+			(void) printf ("%s,%s,%s\n", PQgetvalue (res, i, 3),
+				PQgetvalue (res, i, 4), PQgetvalue (res, i, 5));
 		}
-
-		/* n is the number of commands - 1, that is the last index, 0..n-1. */
-		for (i=0; i<n; i++)
+		else
 		{
-
-			/* Just execute the command string. */
-			status = do_command (t->cmds[i]);
+			(void) printf ("%-16s %-16s %12s %20s %10s %s\n",
+				PQgetvalue (res, i, 0), PQgetvalue (res, i, 1),
+				PQgetvalue (res, i, 3), PQgetvalue (res, i, 4),
+				PQgetvalue (res, i, 5), PQgetvalue (res, i, 2));
 		}
+		dbc->fno += (long long unsigned) atoll (PQgetvalue (res, i, 5));
+		dbc->total += (long long unsigned) atoll (PQgetvalue (res, i, 4));
 	}
-
-	/* Return with the status of the last command. */
-	return (status);
+	dbc->rno += dbc->fno;
+	PQclear (res);
 }
 
-/* Queue command for later parallel execution. */
+/* Scan the directory tree and process the rows. */
 
 static void
-queue_command (work_t *w, char *cs)
+scan (int sort, int batchsize)
 {
-	task_t *t;
-	int i;
 
-	/* Fill in the next available slot, if any. */
-	t = w->tasks[w->nexttask];
-	if (t->nextcmd < t->ncmd)
+	/* Postgres exec result. */
+	PGresult *res;
+
+	/* COPY stream and record. */
+	copyring_t *ring;
+	copyrec_t *rec;
+
+	/* Select statement for COPY. */
+	char *select_cmd;
+
+	/* Keyset page query, last key and parameters. */
+	char *page_cmd;
+	char key_coll[KEY_LENGTH];
+	char key_data[KEY_LENGTH];
+	char key_repl[KEY_LENGTH];
+	char *keys[3];
+
+	/* Number of rows. */
+	int n;
+
+	/* Postgres handle for directories. */
+	pghandle_t *hd;
+
+	/* Postgres handle for files in a directory, none with only the
+	   directories. */
+	pghandle_t *hf = NULL;
+
+	/* Rows and columns. */
+	int i, j;
+
+	/* Collection id. */
+	long long unsigned coll_id;
+
+	/* Directory name length. */
+	int dirname_len;
+
+	/* Directory name. */
+	char *dirname;
+
+	if (report_depth >= 0)
 	{
 
-		/* Still have empty slot with current task, insert command. */
-		if (debug > 5)
-		{
-			msg ("Filling task %d slot %d",
-				w->nexttask, t->nextcmd);
-		}
-		strncpy (t->cmds[t->nextcmd], cs, COMMAND_LENGTH);
-		t->nextcmd++;
+		/* Grouped in the database, no rows to process. */
+		report_tree ();
 	}
-	else
+	else if (aggregate)
 	{
 
-		/* Current task is full, need to move on to the next one. */
-		w->nexttask++;
-		if (w->nexttask < w->ntasks)
-		{
+		/* Nothing to do for the rows, only count them. */
+		count_tree (sort);
+	}
+	else if (keyset)
+	{
 
-			/* We are on the next empty task. */
-			t = w->tasks[w->nexttask];
-			if (t->nextcmd != 0)
+		/* Page through the tree by key, every page is a statement of its
+		   own so no snapshot is held between them. */
+		keys[0] = key_coll;
+		keys[1] = key_data;
+		keys[2] = key_repl;
+		(void) strcpy (key_coll, "0");
+		(void) strcpy (key_data, "0");
+		(void) strcpy (key_repl, "-1");
+		if (dirsonly)
+		{
+			select_cmd = directories_sql (0);
+			page_cmd = keyset_sql (select_cmd,
+				"c.coll_id > $1 ORDER BY c.coll_id", batchsize);
+		}
+		else
+		{
+			select_cmd = tree_sql (0);
+			page_cmd = keyset_sql (select_cmd,
+				"(c.coll_id,d.data_id,d.data_repl_num) > ($1,$2,$3) \
+ORDER BY c.coll_id,d.data_id,d.data_repl_num", batchsize);
+			if (summary)
+			{
+				dbc->dno = count_directories (dbc->conn);
+				dbc->rno += dbc->dno;
+			}
+		}
+		if (debug > 5)
+		{
+			msg ("%s", page_cmd);
+			explain (dbc->conn, page_cmd, dirsonly ? 1 : 3, keys);
+		}
+		capture_plan (dbc->conn, page_cmd, dirsonly ? 1 : 3, keys);
+		res = keyset_page (dbc->conn, page_cmd, dirsonly ? 1 : 3, keys);
+		while (PQntuples (res) > 0)
+		{
+			n = PQntuples (res);
+			dbc->fetches++;
+			dbc->rno += (long long unsigned) n;
+			for (i=0; i<n; i++)
 			{
+				if (dirsonly)
+				{
+					dbc->dno++;
+					dirname = PQgetvalue (res, i, 1);
+					(void) strcpy (dbc->last_path, dirname);
+					process_directory (value_id (PQgetvalue (res, i, 0),
+						PQgetlength (res, i, 0), binary ? 1 : 0), dirname);
+				}
+				else
+				{
+					dbc->fno++;
+					process_file (
+						value_id (PQgetvalue (res, i, 0),
+							PQgetlength (res, i, 0), binary ? 1 : 0),
+						value_id (PQgetvalue (res, i, 1),
+							PQgetlength (res, i, 1), binary ? 1 : 0),
+						PQgetvalue (res, i, 2), PQgetlength (res, i, 2),
+						PQgetvalue (res, i, 3), PQgetlength (res, i, 3));
+				}
+			}
 
-				/* Next task is not empty, we've got an issue. */
-				err (FAILURE,
-					"Moving on to next task but nonempty slots - confused");
+			/* The last row is the key to continue after. */
+			if (dirsonly)
+			{
+				keyset_key (key_coll, res, n - 1, 0);
+			}
+			else
+			{
+				keyset_key (key_coll, res, n - 1, 4);
+				keyset_key (key_data, res, n - 1, 0);
+				keyset_key (key_repl, res, n - 1, 5);
 			}
+			PQclear (res);
+			show_progress (dbc->fetches);
+			res = keyset_page (dbc->conn, page_cmd, dirsonly ? 1 : 3, keys);
+		}
+		PQclear (res);
+		free (page_cmd);
+		free (select_cmd);
+	}
+	else if (copyscan)
+	{
 
-			/* Insert command as first for this task. */
-			if (debug > 5)
+		/* Stream the whole listing with COPY. */
+		if (dirsonly)
+		{
+			select_cmd = directories_sql (sort);
+			ring = copy_open (dbc->dconn, select_cmd);
+			rec = copy_next (ring);
+			while (rec != NULL)
 			{
-				msg ("Filling task %d slot %d", w->nexttask, t->nextcmd);
+				if (rec->nfields < 2 || rec->fields[0] == NULL ||
+					rec->fields[1] == NULL)
+				{
+					err (FAILURE, "Malformed COPY record - confused");
+				}
+				dbc->rno++;
+				dbc->dno++;
+				process_directory (value_id (rec->fields[0], rec->lens[0],
+					ring->format), rec->fields[1]);
+				rec = copy_next (ring);
 			}
-			strncpy (t->cmds[t->nextcmd], cs, COMMAND_LENGTH);
-			t->nextcmd++;
 		}
 		else
 		{
-			/* All tasks full so run the queue. */
-			if (debug > 5)
+			select_cmd = tree_sql (sort);
+			if (summary)
 			{
-				msg ("Start running the queue with %d tasks", w->ntasks);
+				dbc->dno = count_directories (dbc->conn);
+				dbc->rno += dbc->dno;
 			}
-			w->running = true;
-			parallel (w, run_queue);
-
-			/* Finished running the queue, clean up. */
-			if (debug > 5)
+			ring = copy_open (dbc->fconn, select_cmd);
+			rec = copy_next (ring);
+			while (rec != NULL)
 			{
-				msg ("Clean up queue");
+				if (rec->nfields < 4 || rec->fields[0] == NULL ||
+					rec->fields[1] == NULL || rec->fields[2] == NULL ||
+					rec->fields[3] == NULL)
+				{
+					err (FAILURE, "Malformed COPY record - confused");
+				}
+				dbc->rno++;
+				dbc->fno++;
+				process_file (
+					value_id (rec->fields[0], rec->lens[0], ring->format),
+					value_id (rec->fields[1], rec->lens[1], ring->format),
+					rec->fields[2], rec->lens[2],
+					rec->fields[3], rec->lens[3]);
+				rec = copy_next (ring);
 			}
-			w->running = false;
-			w->nexttask = 0;
-			for (i=0; i<w->ntasks; i++)
+		}
+		copy_close (ring);
+		free (select_cmd);
+	}
+	else if (joinscan && ! dirsonly)
+	{
+
+		/* Files in the whole tree with a single select. */
+		hf = select_tree (dbc->fconn, sort, batchsize);
+		dbc->hf = hf;
+		if (summary)
+		{
+			dbc->dno = count_directories (dbc->conn);
+			dbc->rno += dbc->dno;
+		}
+		fetch (hf);
+		dbc->fetches++;
+		dbc->rno += (long long unsigned) hf->nrows;
+		dbc->fno += (long long unsigned) hf->nrows;
+		while ((hf->nrows) > 0)
+		{
+			for (j=0; j<(hf->nrows); j++)
 			{
-				w->tasks[i]->pid = 0;
-				w->tasks[i]->nextcmd = 0;
+
+				/* Collection name is the last column. */
+				dirname = PQgetvalue(hf->res, j, 3);
+				if (dirname == NULL)
+				{
+					err (FAILURE,
+						"Function PQgetvalue returned NULL - confused");
+				}
+				process_file_row (hf, j, dirname,
+					PQgetlength(hf->res, j, 3));
 			}
+
+			/* Next batch of files. */
+			fetch (hf);
+			dbc->fetches++;
+			dbc->rno += (long long unsigned) hf->nrows;
+			dbc->fno += (long long unsigned) hf->nrows;
+			show_progress (dbc->fetches);
 		}
+		closecursor (hf);
+		dbc->hf = NULL;
 	}
-}
+	else
+	{
 
-/* Flush the queue. */
+		/* Prepare the select for files in a directory once. */
+		if (! dirsonly)
+		{
+			if (split_size > 0)
+			{
+				find_giants (dbc->conn);
+			}
+			hf = select_files (dbc->fconn, sort, batchsize);
+			dbc->hf = hf;
+		}
 
-static void
-flush_queue (work_t *w)
-{
-	int i;
+		/* Issue Postgres select for the directory tree. */
+		hd = select_directories (dbc->dconn, sort, batchsize);
+		dbc->hd = hd;
 
-	/* The queue is to be flushed when there is stuff in it. */
-	if ((w->tasks[0]->nextcmd > 0) && (! w->running))
-	{
-		/* At least the first task has stuff and not running. */
-		if (debug > 5)
+		/* Go through the directories. */
+		fetch (hd);
+		dbc->fetches++;
+		dbc->rno += (long long unsigned) hd->nrows;
+		dbc->dno += (long long unsigned) hd->nrows;
+		while (hd->nrows > 0)
 		{
-			msg ("Flushing the queue");
+			for (i=0; i<(hd->nrows); i++)
+			{
+
+				/* Collection internal id and collection name. */
+				coll_id = value_id (PQgetvalue(hd->res, i, 0),
+					PQgetlength(hd->res, i, 0), hd->format);
+				dirname = PQgetvalue(hd->res, i, 1);
+				if (dirname == NULL)
+				{
+					err (FAILURE,
+						"Function PQgetvalue returned NULL - confused");
+				}
+				dirname_len = PQgetlength(hd->res, i, 1);
+				(void) strcpy (dbc->last_path, dirname);
+
+				/* If we do only directories. Watching, the change may
+				   have been processed by an earlier poll. */
+				if (dirsonly && watch_seconds > 0 && hd->nfields > 2 &&
+					! first_change (coll_id, -1, (long long) value_id (
+					PQgetvalue(hd->res, i, 2), PQgetlength(hd->res, i, 2),
+					hd->format)))
+				{
+					dbc->dno--;
+				}
+				else if (dirsonly)
+				{
+					process_directory (coll_id, dirname);
+				}
+				else if (is_giant (coll_id))
+				{
+
+					/* Too many files for one cursor. */
+					split_collection (coll_id, dirname, dirname_len,
+						batchsize);
+				}
+				else
+				{
+
+					/* Files were asked so now the files in the directory. */
+					if (replica_any)
+					{
+						forget_replicas ();
+					}
+					open_cursor (hf, coll_id);
+					fetch (hf);
+					dbc->fetches++;
+					dbc->rno += (long long unsigned) hf->nrows;
+					dbc->fno += (long long unsigned) hf->nrows;
+					while ((hf->nrows) > 0)
+					{
+						for (j=0; j<(hf->nrows); j++)
+						{
+							process_file_row (hf, j, dirname, dirname_len);
+						}
+
+						/* Next batch of files. */
+						fetch (hf);
+						dbc->fetches++;
+						dbc->rno += (long long unsigned) hf->nrows;
+						dbc->fno += (long long unsigned) hf->nrows;
+						show_progress (dbc->fetches);
+					}
+					endcursor (hf);
+				}
+			}
+			fetch (hd);
+			dbc->fetches++;
+			dbc->rno += (long long unsigned) hd->nrows;
+			dbc->dno += (long long unsigned) hd->nrows;
+			show_progress (dbc->fetches);
 		}
-		w->running = true;
-		parallel (w, run_queue);
-		w->running = false;
-		w->nexttask = 0;
-		for (i=0; i<w->ntasks; i++)
+		closecursor (hd);
+		dbc->hd = NULL;
+		if (! dirsonly)
 		{
-			w->tasks[i]->pid = 0;
-			w->tasks[i]->nextcmd = 0;
+			closecursor (hf);
+			dbc->hf = NULL;
 		}
 	}
 }
 
-/* Execute command for a pathname. */
+/* Scan the tree with nparts processes, each with its own connection
+   reading the snapshot and the collections with ids in its partition.
+   The rows are processed in the scanning process. */
 
 static void
-execute (int ntasks, char *command, char *path)
+scan_partitions (int sort, int batchsize)
 {
-	char cs[COMMAND_LENGTH];
-	int status;
-
-	/* Skip when the path does not match regexp. */
-	if (regexp != NULL)
-	{
-		if (! rmatch (path))
-		{
-			return;
-		}
-	}
+	int fds[2];
+	int i;
 
-	/* NOP when no command was specified. */
-	if (command != NULL)
+	open_child_scans (fds);
+	for (i=0; i<nparts; i++)
 	{
-		build_command (cs, command, path);
-		if (ntasks > 0)
-		{
-			queue_command (work, cs);
-		}
-		else
+		if (fork_child_scan (fds) == (pid_t) 0)
 		{
-			status = do_command (cs);
-		}
-	}
-	else
-	{
 
-		/* No command specified. Also we should run only one
-		   task (garbled output). */
-		if (ntasks > 0 )
-		{
-			err (FAILURE, "Cannot multitask when no command was specified");
+			/* Child, the split collections are reported here. */
+			part = i;
+			scan (sort, batchsize);
+			if (summary)
+			{
+				print_splits ();
+			}
+			end_child_scan (fds[1]);
 		}
-
-		/* And just fail out anyway. */
-		err (FAILURE, "No command to execute");
 	}
+	(void) wait_child_scans (fds, nparts);
 }
 
 /* Print help. */
@@ -1772,34 +7748,68 @@ print_help (void)
 This program is like the find utility, for iRODS.\n\
 Processes a directory tree and executes a command for each file/collection.\n\
 Usage:\n\
-    find [-h][-C connection][-D][-E resource][-I][-Q sql][R n,w,m]\n\
-        [-S][-X regexp][-Y subst]\n\
-        [-b batchsize][-c command][-d level][-f][-l n][-n n]\n\
-        [-p n][-q][-r n][-s type][-t][-u locale][-v]\n\
-        collection\n\
+    find [-h][-A ms[,kib]][-B][-C connection][-D][-E resource][-F pct]\n\
+        [-G depth][-I][-K][-L file][-P n][-Q sql][R n,w,m][-S]\n\
+        [-T file][-U n][-W secs][-X regexp][-Y subst][-Z file][-a]\n\
+        [-b batchsize][-c command][-d level][-e expr][-f][-i][-j][-k]\n\
+        [-l n][-m avu][-n n][-o format][-p n][-q][-r n][-s type][-t]\n\
+        [-u locale][-v][-w n[,t]][-x pattern][-y policy][-z size[,n]]\n\
+        collection ...\n\
 where\n\
     -h              prints this help\n\
+    -A ms[,kib]     adapt the fetch size to take ms milliseconds and at most\n\
+                    kib KiB of memory, the default is 4096. With ms 0, and\n\
+                    with -a, to the memory only.\n\
+    -B              binary result format for the scan queries.\n\
     -C connection   is the connect details for the database. Quoted string.\n\
                     The default is 'dbname=ICAT user=irods'.\n\
     -D              Select directories/collections only.\n\
                     In this case files will not be listed.\n\
                     The default is to list files.\n\
     -E resource     restrict to this resource.\n\
+    -F pct          estimate the tree first sampling pct percent of the data\n\
+                    pages, 0 for the planner, and pick the batch size, the\n\
+                    tasks for -c and show the ETA with -p from it.\n\
+    -G depth        report objects, bytes and replicas by resource, owner\n\
+                    and collection at depth below the root.\n\
     -I              also print file IDs.\n\
+    -K              stream the listing with COPY instead of cursors.\n\
+    -L file         also scan the collections in the file, one per line.\n\
+    -P n            scan with n parallel connections, no sorting.\n\
     -Q sql          execute SLQ command with object id.\n\
     -R n,w,m        retry failed command n times after waiting for w seconds,\n\
                     allow m retries all in all\n\
     -S              print summary.\n\
+    -T file         incremental, select what changed since the time in the\n\
+                    state file, save the time of this scan when done.\n\
+    -U n            execute the SQL statement for arrays of n ids, $1 is\n\
+                    a bigint[], as in data_id = ANY($1).\n\
+    -W secs         watch, poll for new and changed objects every secs\n\
+                    seconds after the scan until interrupted.\n\
     -X regexp       Match regexp.\n\
     -Y substitute   Substitute matching regexp with this.\n\
+    -Z file         append EXPLAIN ANALYZE of the scan queries to the file.\n\
+    -a              prefetch the next batch while processing the current.\n\
     -b batchsize    is the number of rows to process in one go.\n\
                     The default is 1024.\n\
     -c command      is the command to execute for all files/directories.\n\
                     Quoted string. The default is to print the pathname.\n\
     -d level        set the debug level, greater for more details.\n\
+    -e expr         select files with a find like expression of -size,\n\
+                    -name, -path, -mindepth, -maxdepth, -mtime, -ctime,\n\
+                    -newermt, -newerct, -owner, -resc and -status joined\n\
+                    with -a, -o, -not and parentheses. Quoted string.\n\
     -f              force, continue when the command returns non-zero status.\n\
+    -i              print the statements with rows, bytes and latencies.\n\
+    -j              list files of the whole tree with a single join.\n\
+    -k              keyset scan in short transactions, reconnects.\n\
     -l length       check if any file pathnames longer then specified.\n\
-    -n n            number of parallel worker tasks.\n\
+    -m avu          select objects with metadata attr[op value[;unit]],\n\
+                    op is =, !=, <, <=, > or >=, value* is a prefix.\n\
+                    Repeat for more conditions.\n\
+    -n n            number of parallel worker tasks, running the commands\n\
+                    queued by the scan as they come.\n\
+    -o format       report format, table or csv, the default is table.\n\
     -p n            show progress indicator for every n files.\n\
     -q              set quiet.\n\
     -r n            replica number, the default is all replicas\n\
@@ -1809,7 +7819,17 @@ where\n\
     -t              test, print command string.\n\
     -u locale       check pathname according to specified locale.\n\
     -v              set verbose.\n\
+    -w n[,t]        pipeline the SQL statements on a connection of their own,\n\
+                    commit every n statements or t seconds, report failed ids.\n\
+    -x pattern      leave out the collections matching the glob pattern\n\
+                    and everything below them, @file reads the patterns\n\
+                    from a file, one per line. Repeat for more patterns.\n\
+    -y policy       one replica of every object, any for the first seen, or\n\
+                    good, resc=a:b and high or low in order of preference.\n\
+    -z size[,n]     scan collections of size files in n ranges in parallel.\n\
+                    The default n is 4.\n\
     collection      is a collection/directory to use as root of the tree.\n\
+                    More roots are scanned in the same pass.\n\
 ");
 	 exit (FAILURE);
 }
@@ -1824,51 +7844,45 @@ main (int argc, char *argv[])
 	int status;
 
 	/* Option string. */
-	char *options = "hC:DE:IQ:R:SX:Y:b:c:d:fl:n:p:qr:s:tu:v";
+	char *options = "hA:BC:DE:F:G:IKL:P:Q:R:ST:U:W:X:Y:Z:ab:c:d:e:fijkl:m:n:o:p:qr:s:tu:vw:x:y:z:";
 
 	/* Getopt option. */
 	int ch;
 
-	/* Connect string from command line. */
-	char *connect_string = "dbname=ICAT user=irods";
-
-	/* Directories only. */
-	boolean dirsonly = false;
-
-	/* Print file id with the name. */
-	boolean printid = false;
-
 	/* Batch size, number of rows to process in one go. */
 	int batchsize = 1024;
 
+	/* Batch size given with the switch. */
+	int batchsize_given = false;
+
 	/* Sort type. */
 	int sort = 0;
 
-	/* State from strtok call. */
+	/* Metadata condition and where to append it. */
+	avu_t *avu;
+	avu_t **avu_tail;
+	prune_t *prune;
+
+	/* State and token from strtok call. */
 	char *state;
+	char *token;
 
 	/* Retry, delay, max retry. */
 	int rtr;
 	int dly;
 	int mrt;
 
-	/* Command to execute for all files. */
-	char *command = NULL;
-
-	/* UTF-8 checker locale. */
-	char *utf = NULL;
-
-	/* Number of tasks, 0 means paralellism disabled. */
-	int ntasks = 0;
-
 	/* Old locale from setlocale. */
 	char *oldlocale;
 
-	/* Directory name. */
-	char *directory = "";
+	/* Root index. */
+	int i;
 
-	/* Directory name length. */
-	size_t directory_len;
+	/* Number of the poll watching, its start and the largest object id
+	   it saw. */
+	int poll;
+	long long poll_start = 0;
+	long long poll_id = 0;
 
 	/* Signal action block to sigaction. */
 	struct sigaction sig;
@@ -1879,45 +7893,6 @@ main (int argc, char *argv[])
 	/* Postgres exec result. */
 	PGresult *res;
 
-	/* Postgres handle for directories. */
-	pghandle_t *hd;
-
-	/* Postgres handle for files in a directory. */
-	pghandle_t *hf;
-
-	/* Rows and columns. */
-	int i, j;
-
-	/* Collection id. */
-	char *coll_id;
-
-	/* Directory name. */
-	char *dirname;
-
-	/* Directory name tranformed with regexp. */
-	char *tdirname;
-
-	/* File name. */
-	char *filename;
-
-	/* File size. */
-	long long unsigned filesize;
-
-	/* File id (column dat_id in r_data_main). */
-	long long unsigned fileid;
-
-	/* Path name. */
-	char *pathname;
-
-	/* Path name transformed. */
-	char *tpathname;
-
-	/* If there was a regexp match for directory. */
-	int dmatch = false;
-
-	/* If there was a regexp match for a file. */
-	int fmatch = false;
-
 	/* Get command line switches. */
 	ch = getopt (argc, argv, options);
 	while (ch != EOF)
@@ -1927,6 +7902,24 @@ main (int argc, char *argv[])
 		case 'h':
 			print_help ();
 			break;
+		case 'A':
+
+			/* Target milliseconds and optional KiB per fetch. */
+			adapt_time = atof (strtok_r (optarg, ",", &state)) / 1000.0;
+			token = strtok_r (NULL, ",", &state);
+			if (token != NULL)
+			{
+				adapt_memory = atof (token) * 1024.0;
+			}
+			if (adapt_time < 0.0 || adapt_memory <= 0.0)
+			{
+				err (FAILURE, "Wrong format for adaptive fetch size");
+			}
+			adaptive = true;
+			break;
+		case 'B':
+			binary = true;
+			break;
 		case 'C':
 			connect_string = optarg;
 			break;
@@ -1936,9 +7929,38 @@ main (int argc, char *argv[])
 		case 'E':
 			resource = optarg;
 			break;
+		case 'F':
+			preflight_percent = strtod (optarg, &token);
+			if (token == optarg || *token != EOS || preflight_percent < 0.0 ||
+				preflight_percent > 100.0)
+			{
+				err (FAILURE, "Wrong percent for preflight sample");
+			}
+			break;
+		case 'G':
+			report_depth = strtol (optarg, &token, 10);
+			if (token == optarg || *token != EOS || report_depth < 0)
+			{
+				err (FAILURE, "Wrong number for report depth");
+			}
+			break;
 		case 'I':
 			printid = true;
 			break;
+		case 'K':
+			copyscan = true;
+			break;
+		case 'L':
+			read_list (optarg, "root", &add_root);
+			break;
+		case 'P':
+			nparts = atoi (optarg);
+			if (nparts <= 0 || nparts > MAX_TASKS)
+			{
+				err (FAILURE, "Wrong number for parallel scans, 0 < n <= %d",
+					MAX_TASKS);
+			}
+			break;
 		case 'Q':
 			sqlstmt = optarg;
 			break;
@@ -1963,6 +7985,23 @@ main (int argc, char *argv[])
 		case 'S':
 			summary = true;
 			break;
+		case 'T':
+			state_file = optarg;
+			break;
+		case 'U':
+			sqlbatch = atoi (optarg);
+			if (sqlbatch <= 0)
+			{
+				err (FAILURE, "Wrong number of ids for the SQL statement");
+			}
+			break;
+		case 'W':
+			watch_seconds = atoi (optarg);
+			if (watch_seconds <= 0)
+			{
+				err (FAILURE, "Wrong number of seconds between polls");
+			}
+			break;
 		case 'X':
 			regexp = optarg;
 
@@ -1990,12 +8029,24 @@ main (int argc, char *argv[])
 				err (FAILURE, "Need to specify -X regexp with -Y");
 			}
 			break;
+		case 'Z':
+			plan_fd = open (optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if (plan_fd < 0)
+			{
+				err (FAILURE, "Cannot open plan file %s: %s", optarg,
+					strerror (errno));
+			}
+			break;
+		case 'a':
+			prefetch = true;
+			break;
 		case 'b':
 			batchsize = atoi (optarg);
 			if (batchsize <= 0)
 			{
 				err (FAILURE, "Wrong number for batch size");
 			}
+			batchsize_given = true;
 			break;
 		case 'c':
 			command = optarg;
@@ -2015,15 +8066,38 @@ main (int argc, char *argv[])
 				err (FAILURE, "Wrong number for debug level");
 			}
 			break;
+		case 'e':
+			expression = optarg;
+			break;
 		case 'f':
 			force = true;
 			break;
+		case 'i':
+			print_stats = true;
+			break;
+		case 'j':
+			joinscan = true;
+			break;
+		case 'k':
+			keyset = true;
+			break;
 		case 'l':
 			check_length = atoi (optarg);
 			if (check_length <= 0)
 			{
-				err (FAILURE, "Wrong number for pathname length check");
+				err (FAILURE, "Wrong number for pathname length check");
+			}
+			break;
+		case 'm':
+
+			/* All the conditions must be met, keep them in order. */
+			avu = parse_avu (optarg);
+			avu_tail = &avus;
+			while (*avu_tail != NULL)
+			{
+				avu_tail = &(*avu_tail)->next;
 			}
+			*avu_tail = avu;
 			break;
 		case 'n':
 			ntasks = atoi (optarg);
@@ -2032,6 +8106,16 @@ main (int argc, char *argv[])
 				err (FAILURE, "Wrong number for number of workers");
 			}
 			break;
+		case 'o':
+			if (strcmp (optarg, "csv") == 0)
+			{
+				report_csv = true;
+			}
+			else if (strcmp (optarg, "table") != 0)
+			{
+				err (FAILURE, "Wrong output format %s", optarg);
+			}
+			break;
 		case 'p':
 			progress = atoi (optarg);
 			if (progress <= 0)
@@ -2077,6 +8161,55 @@ main (int argc, char *argv[])
 		case 'v':
 			verbose = true;
 			break;
+		case 'w':
+#ifndef LIBPQ_HAS_PIPELINING
+			err (FAILURE, "The write connection needs libpq 14 or later");
+#endif
+
+			/* Statements in a commit and optional seconds. */
+			write_group = atoi (strtok_r (optarg, ",", &state));
+			token = strtok_r (NULL, ",", &state);
+			if (token != NULL)
+			{
+				write_seconds = atof (token);
+			}
+			if (write_group <= 0 || write_seconds < 0.0)
+			{
+				err (FAILURE, "Wrong format for statements and seconds of a commit");
+			}
+			break;
+		case 'y':
+			replica_policy = optarg;
+			replica_any = strcmp (replica_policy, "any") == 0;
+			break;
+		case 'x':
+
+			/* A pattern or @ and a file of patterns. */
+			if (optarg[0] == '@')
+			{
+				read_list (optarg + 1, "prune", &add_prune);
+			}
+			else
+			{
+				add_prune (optarg);
+			}
+			break;
+		case 'z':
+
+			/* Split size and optional number of ranges. */
+			split_size = (long long unsigned) atoll (strtok_r (optarg, ",",
+				&state));
+			token = strtok_r (NULL, ",", &state);
+			if (token != NULL)
+			{
+				split_ranges = atoi (token);
+			}
+			if (split_size == 0 || split_ranges <= 1 ||
+				split_ranges > MAX_TASKS)
+			{
+				err (FAILURE, "Wrong format for split size and ranges");
+			}
+			break;
 		case '?':
 			err (FAILURE, "Unknown switch");
 			break;
@@ -2096,22 +8229,133 @@ main (int argc, char *argv[])
 	{
 		err (FAILURE, "Do not specify both force and retry");
 	}
+	if (keyset && sort != 0)
+	{
+		err (FAILURE, "Cannot sort with keyset scan");
+	}
+	if (prefetch && adapt_time > 0.0)
+	{
+		err (FAILURE, "A prefetched fetch is not timed, adapt to the memory with -A 0,kib");
+	}
+	if (keyset && (prefetch || copyscan))
+	{
+		err (FAILURE, "Do not specify keyset scan with prefetch or COPY");
+	}
+	if (nparts > 0 && (keyset || sort != 0))
+	{
+		err (FAILURE, "Cannot sort or keyset scan with parallel scans");
+	}
+	if (expression != NULL && dirsonly)
+	{
+		err (FAILURE, "The expression selects files, not with -D");
+	}
+	if (split_size > 0 && (keyset || copyscan || joinscan || dirsonly ||
+		sort != 0))
+	{
+		err (FAILURE, "Splitting works with the unsorted per collection scan");
+	}
+	if (report_depth >= 0 && (command != NULL || sqlstmt != NULL ||
+		dirsonly || nparts > 0 || split_size > 0 || keyset ||
+		check_length > 0 || utf != NULL))
+	{
+		err (FAILURE, "The usage report is counted, not with a per file option");
+	}
+	if (report_csv && report_depth < 0)
+	{
+		err (FAILURE, "The output format is for the usage report");
+	}
+	if ((write_group > 0 || sqlbatch > 0) && sqlstmt == NULL)
+	{
+		err (FAILURE, "The write connection and id arrays are for the SQL statement");
+	}
+	if (write_group > 0 && sqlbatch > 0)
+	{
+		err (FAILURE, "Do not specify both write connection and id arrays");
+	}
+	sqltext = sqlstmt != NULL && sqlstmt_is_text (sqlstmt);
+	if (sqltext && (write_group > 0 || sqlbatch > 0))
+	{
+		err (FAILURE, "The write connection and id arrays need a SQL statement \
+without %%llu in quotes and without several statements");
+	}
+	if (replica != NULL && replica_policy != NULL)
+	{
+		err (FAILURE, "Do not specify both replica number and policy");
+	}
+	if ((state_file != NULL || watch_seconds > 0) && report_depth >= 0)
+	{
+		err (FAILURE, "The usage report is of the whole tree, not incremental");
+	}
+	if (state_file != NULL)
+	{
+		read_watermark ();
+	}
+	if (replica_policy != NULL)
+	{
+
+		/* Check the preferences before connecting. */
+		free (replica_policy_sql ("", ""));
+	}
+
+	/* Let the database filter the rows when it gives the same result.
+	   The length check only filters when nothing else is asked. */
+	pushdown_regexp = regexp != NULL && regexp_translatable (regexp);
+	pushdown_length = check_length > 0 && command == NULL &&
+		sqlstmt == NULL && utf == NULL && ! printid && ! verbose;
+
+	/* When there is nothing to do for the rows the summary is all. */
+	aggregate = summary && command == NULL && sqlstmt == NULL &&
+		regexp == NULL && check_length == 0 && utf == NULL && ! printid &&
+		! verbose;
 
 	/* Check for arguments. */
-	if (argc < 2)
+	if (optind > argc)
+	{
+		err (FAILURE, "Wrong optind in getopt processing - confused");
+	}
+
+	/* Get the directory names (iRODS collections), the root file ones
+	   were added with the switches. */
+	for (i=optind; i<argc; i++)
+	{
+		add_root (argv[i]);
+	}
+	if (nroots == 0)
 	{
 		err (FAILURE, "iRODS collection must be specified");
 	}
-	if (optind > argc)
+	sort_roots ();
+
+	/* Only the file count looks at the metadata. */
+	aggregate = aggregate && ! (dirsonly && avus != NULL);
+
+	/* Compile the expression before the queries are built. */
+	if (expression != NULL)
 	{
-		err (FAILURE, "Wrong optind in getopt processing - confused");
+		expr_compile (expression);
+		aggregate = aggregate && expr_client == NULL;
+	}
+	if (report_depth >= 0 && ((regexp != NULL && ! pushdown_regexp) ||
+		expr_client != NULL))
+	{
+		err (FAILURE, "The usage report needs conditions the database can match");
+	}
+
+	/* The database picks the best replica among those the conditions
+	   select, so it has to evaluate those which differ by replica. */
+	if (replica_policy != NULL && ! replica_any && expr_has_size (expr_client))
+	{
+		err (FAILURE, "The replica policy needs a -size the database can match");
 	}
 
-	/* Get directory name (iRODS collection). */
-	directory = argv[optind];
-	if (directory == NULL)
+	/* The client keeps the first replica of an object only in the scan
+	   by collection, elsewhere the ids seen would be all of the tree. The
+	   database keeps the lowest replica number then, as good as any. */
+	if (replica_any && (aggregate || report_depth >= 0 || keyset ||
+		copyscan || (joinscan && ! dirsonly)))
 	{
-		err (FAILURE, "iRODS collection is NULL - confused");
+		replica_policy = "low";
+		replica_any = false;
 	}
 
 	/* Print debug info. */
@@ -2127,6 +8371,11 @@ main (int argc, char *argv[])
 			msg ("Summary requested");
 		}
 		msg ("Batch size is %d", batchsize);
+		if (adaptive)
+		{
+			msg ("Adaptive fetch size for %.0f ms and %.0f KiB",
+				adapt_time * 1000.0, adapt_memory / 1024.0);
+		}
 		if (command != NULL)
 		{
 			msg ("Command string is '%s'", command);
@@ -2139,10 +8388,56 @@ main (int argc, char *argv[])
 		{
 			msg ("Ignore errors when running commands");
 		}
+		if (joinscan)
+		{
+			msg ("Join scan for files");
+		}
+		if (prefetch)
+		{
+			msg ("Prefetch is on");
+		}
+		if (copyscan)
+		{
+			msg ("COPY scan is on");
+		}
+		if (binary)
+		{
+			msg ("Binary results");
+		}
+		if (keyset)
+		{
+			msg ("Keyset scan");
+		}
+		if (aggregate)
+		{
+			msg ("Summary only, counting in the database");
+		}
+		if (report_depth >= 0)
+		{
+			msg ("Usage report at depth %d%s", report_depth,
+				report_csv ? " as CSV" : "");
+		}
+		if (nparts > 0)
+		{
+			msg ("Number of parallel scans is %d", nparts);
+		}
+		if (split_size > 0)
+		{
+			msg ("Collections of %llu files split in %d ranges", split_size,
+				split_ranges);
+		}
 		if (ntasks > 0)
 		{
 			msg ("Number of worker tasks is %d", ntasks);
 		}
+		if (print_stats)
+		{
+			msg ("Statement statistics in the summary");
+		}
+		if (plan_fd >= 0)
+		{
+			msg ("Plans of the scan queries captured");
+		}
 		msg ("Sort type is %d", sort);
 		if (verbose)
 		{
@@ -2152,6 +8447,11 @@ main (int argc, char *argv[])
 		{
 			msg ("Progress indicator is %d", progress);
 		}
+		if (preflight_percent >= 0.0)
+		{
+			msg ("Preflight estimate sampling %g%% of the data pages",
+				preflight_percent);
+		}
 		if (quiet)
 		{
 			msg ("Quiet is on");
@@ -2171,6 +8471,29 @@ main (int argc, char *argv[])
 		{
 			msg ("Replica is %s", replica);
 		}
+		if (state_file != NULL)
+		{
+			msg ("Changes since %lld from state file %s", watermark,
+				state_file);
+		}
+		if (watch_seconds > 0)
+		{
+			msg ("Polling for changes every %d seconds", watch_seconds);
+		}
+		if (sqlbatch > 0)
+		{
+			msg ("SQL statement for arrays of %d ids", sqlbatch);
+		}
+		if (write_group > 0)
+		{
+			msg ("SQL statements commit in groups of %d or %.1f seconds",
+				write_group, write_seconds);
+		}
+		if (replica_policy != NULL)
+		{
+			msg ("Replica policy is %s%s", replica_policy,
+				replica_any ? ", first replica seen" : "");
+		}
 		if (test)
 		{
 			msg ("Test is on");
@@ -2183,36 +8506,34 @@ main (int argc, char *argv[])
 		{
 			msg ("Regexp to match is '%s'", regexp);
 		}
-		msg ("Directory string is '%s'", directory);
-	}
-
-	if (ntasks > 0)
-	{
-		if (! (PQisthreadsafe()))
+		if (pushdown_regexp)
 		{
-			err (FAILURE,
-				"Postgres library libpq is not thread safe - confused");
+			msg ("Regexp matched by the database");
+		}
+		for (prune = prunes; prune != NULL; prune = prune->next)
+		{
+			msg ("Pruning '%s' and below", prune->pattern);
+		}
+		for (avu = avus; avu != NULL; avu = avu->next)
+		{
+			msg ("Metadata %s %s %s%s%s", avu->attr, avu->op,
+				avu->value != NULL ? avu->value : "any",
+				avu->unit != NULL ? " unit " : "",
+				avu->unit != NULL ? avu->unit : "");
+		}
+		if (expression != NULL)
+		{
+			msg ("Expression is '%s'%s", expression,
+				expr_client != NULL ? ", partly evaluated by ifind" : "");
+		}
+		if (pushdown_length)
+		{
+			msg ("Length checked by the database");
+		}
+		for (i=0; i<nroots; i++)
+		{
+			msg ("Directory string is '%s'", roots[i].name);
 		}
-		work = create_work (ntasks, batchsize);
-	}
-
-	/* Check directory string. */
-	directory_len = strlen (directory);
-	if (directory_len == 0)
-	{
-		err (FAILURE, "Directory string empty - confused");
-	}
-	if (*(directory + directory_len - 1) == SLASH)
-	{
-
-		/* The last character is slash. */
-		err (FAILURE, "Directory name should not have trailing slash");
-	}
-	if (! (*directory == SLASH))
-	{
-
-		/* The first character is not slash. */
-		err (FAILURE, "Directory name should be an absolute pathname");
 	}
 
 	/* Establish signal handlers. */
@@ -2225,6 +8546,7 @@ main (int argc, char *argv[])
 	dbc = create_dbc ();
 
 	/* Mark start. */
+	dbc->startclock = clock_seconds ();
 	dbc->starttime = time (NULL);
 	if (dbc->starttime == (time_t) -1)
 	{
@@ -2240,10 +8562,6 @@ main (int argc, char *argv[])
 	}
 	dbc->conn = conn;
 
-	/* Start transaction block. We are only reading, which is the default. */
-	res = pcmd (conn, "BEGIN");
-	PQclear (res);
-
 	/* Full pathname. */
 	pathname = (char *) allocate (PATHNAME_LENGTH);
 
@@ -2253,225 +8571,154 @@ main (int argc, char *argv[])
 	/* Transformed directory name. */
 	tdirname = (char *) allocate (PATHNAME_LENGTH);
 
-	/* Issue Postgres select for the directory tree. */
-	hd = select_directories (conn, sort, batchsize, directory);
-	dbc->hd = hd;
-
-	/* Go through the directories. */
-	fetch (hd);
-	dbc->fetches++;
-	dbc->rno += (long long unsigned) hd->nrows;
-	dbc->dno += (long long unsigned) hd->nrows;
-	while (hd->nrows > 0)
+	/* One scan, or when watching one for every poll until interrupted.
+	   The connections and the tasks are kept between the polls. */
+	for (poll=0; ; poll++)
 	{
-		for (i=0; i<(hd->nrows); i++)
+
+		/* Start transaction block. We are only reading, which is the
+		   default. The keyset scan runs every statement in its own
+		   transaction. */
+		if (! keyset)
 		{
+			res = pcmd (conn, "BEGIN");
+			PQclear (res);
+		}
 
-			/* Collection internal id and collection name. */
-			coll_id = PQgetvalue(hd->res, i, 0);
-			if (coll_id == NULL)
-			{
-				err (FAILURE, "Function PQgetvalue returned NULL - confused");
-			}
-			dirname = PQgetvalue(hd->res, i, 1);
-			if (dirname == NULL)
-			{
-				err (FAILURE,
-					"Function PQgetvalue returned NULL - confused");
-			}
-			(void) strcpy (dbc->last_path, dirname);
+		/* The next incremental scan starts a while before this one, in
+		   the time of the database. The next poll starts with this one
+		   and the largest object id now. */
+		if (state_file != NULL || watch_seconds > 0)
+		{
+			res = pcmd (conn, "SELECT extract(epoch FROM now())::bigint,\
+(SELECT coalesce(max(data_id),0) FROM r_data_main)");
+			poll_start = atoll (PQgetvalue (res, 0, 0));
+			poll_id = atoll (PQgetvalue (res, 0, 1));
+			next_watermark = poll_start - WATERMARK_SLACK;
+			PQclear (res);
+		}
+		if (poll == 0 && watch_seconds > 0)
+		{
+			note_changes (conn);
+		}
 
-			/* If we do only directories. */
-			if (dirsonly)
+		/* Estimate the tree first when asked, the batch size and the
+		   tasks may follow from it. */
+		if (poll == 0 && preflight_percent >= 0.0)
+		{
+			preflight ();
+			preflight_defaults (&batchsize, batchsize_given);
+		}
+		/* The parallel scan processes have workers of their own, this
+		   process only when it scans too. */
+		work_slots = batchsize;
+		if (ntasks > 0 && work == NULL && nparts == 0)
+		{
+			if (! (PQisthreadsafe()))
 			{
-
-				/* Transform path accordingly to regexp. */
-				dmatch = transformpath (tdirname, dirname);
-
-				/* Print transformed directory name when verbose. */
-				if (dmatch && verbose)
-				{
-					info ("%s", tdirname);
-				}
-
-				/* Print transformed name with file ID. */
-				/* Attention! This listing might be misleading showing
-				   IDs with names which are not the real names. */
-				if (dmatch && printid)
-				{
-
-					/* Print transformed name with id. */
-					info ("%24s %s", coll_id, tdirname);
-				}
-
-				/* Execute command  for the directory with the
-				   transformed name when required. */
-				if (dmatch && (command != NULL))
-				{
-					execute (ntasks, command, tdirname);
-				}
-
-				/* Execute SQL statement with the transformed directory
-				   name when required. */
-				if (dmatch && (sqlstmt != NULL))
-				{
-					execute_sqlstmt (conn, sqlstmt,
-						(long long unsigned) atoll (coll_id), tdirname);
-				}
-
-				/* When the name is too long. */
-				if (dmatch && (check_length > 0))
-				{
-
-					/* Length check required print the name if too long. */
-					if (strlen (pathname) > check_length)
-					{
-						info ("%s", pathname);
-					}
-				}
+				err (FAILURE,
+					"Postgres library libpq is not thread safe - confused");
 			}
-			else
-			{
-
-				/* Files were asked so now the files in the directory. */
-				hf = select_files (conn, sort, batchsize, coll_id);
-				dbc->hf = hf;
-				fetch (hf);
-				dbc->fetches++;
-				dbc->rno += (long long unsigned) hf->nrows;
-				dbc->fno += (long long unsigned) hf->nrows;
-				while ((hf->nrows) > 0)
-				{
-					for (j=0; j<(hf->nrows); j++)
-					{
-
-						/* File name. */
-						filename = PQgetvalue(hf->res, j, 2);
-						if (filename == NULL)
-						{
-							err (FAILURE,
-								"Function PQgetvalue returned NULL - confused");
-						}
-
-						/* File size. */
-						filesize = (long long unsigned)
-							atol (PQgetvalue(hf->res, j, 1));
-						dbc->total += filesize;
-
-						/* File id. */
-						fileid = (long long unsigned)
-							atol (PQgetvalue(hf->res, j, 0));
-
-						/* File info. */
-						if ((strlen (dirname) + strlen (filename) + 2) >
-							PATHNAME_LENGTH)
-						{
-							err (FAILURE, "Pathname too long");
-						}
-						(void) strcpy (pathname, dirname);
-						(void) strcat (pathname, "/");
-						(void) strcat (pathname, filename);
-						(void) strcpy (dbc->last_path, pathname);
-
-						/* If the file name matches regexp. */
-						fmatch = transformpath (tpathname, pathname);
-
-						/* Print transformed name if matches and verbose. */
-						if (fmatch && verbose)
-						{
-							info ("%s", tpathname);
-						}
-
-						/* Print transformed name with ID. */
-						/* Attention! This listing might be misleading showing
-						   IDs with names which are not the real names. */
-						if (fmatch && printid)
-						{
-
-							/* Print transformed name with id. */
-							info ("%24llu %s", fileid, tpathname);
-						}
+			work = create_work (ntasks, work_slots);
+		}
 
-						/* Check for UTF conformance. */
-						if (fmatch && (utf != NULL))
-						{
-							if (! is_utf (pathname))
-							{
-
-								/* Print non-conforming transformed path. */
-								msg ("%s", tpathname);
-
-								/* Execute command for malformed
-								   path if there is any. */
-								if (command != NULL)
-								{
-									execute (ntasks, command, tpathname);
-								}
-								dbc->nutfno++;
-							}
-						}
+		/* With prefetch or COPY the scans need their own connections
+		   since a connection can have only one command in progress, and
+		   parallel partitions and split collections have connections of
+		   their own. They all read the same snapshot as this
+		   transaction. */
+		if (prefetch || copyscan || nparts > 0 || split_size > 0)
+		{
+			dbc->snapshot = export_snapshot (conn);
+		}
+		if (nparts == 0)
+		{
+			open_scans (dbc->snapshot);
+		}
 
-						/* Execute command when required. */
-						if (fmatch && command != NULL)
-						{
-							execute (ntasks, command, tpathname);
-						}
+		/* An object seen by the last poll may have changed since. */
+		if (replica_any)
+		{
+			forget_replicas ();
+		}
 
-						/* SQL statement on transformed path. */
-						if (fmatch && sqlstmt != NULL)
-						{
-							execute_sqlstmt (conn, sqlstmt,
-								fileid, tpathname);
-						}
+		/* Scan the tree, in parallel partitions when asked. */
+		if (nparts > 0)
+		{
+			scan_partitions (sort, batchsize);
+		}
+		else
+		{
+			scan (sort, batchsize);
+		}
 
-						/* When the name is too long. */
-						if (fmatch && (check_length > 0))
-						{
+		/* Last flush when needed. */
+		if (work != NULL)
+		{
 
-							/* Length check required, print the
-							   name if it is too long. */
-							if (strlen (pathname) > check_length)
-							{
-								info ("%s", tpathname);
-							}
-						}
+			/* Flush queue if it was parallel. */
+			flush_queue (work);
+		}
 
-						/* Nothing was asked, nothing to do. */
-					}
+		/* Finish. */
+		flush_sqlbatch (conn);
+		drain_write_connection ();
+		close_scans ();
+		if (! keyset)
+		{
+			res = pcmd (conn, "END");
+			PQclear (res);
+		}
+		free (dbc->snapshot);
+		dbc->snapshot = NULL;
+		if (watch_seconds == 0)
+		{
+			break;
+		}
 
-					/* Next batch of files. */
-					fetch (hf);
-					dbc->fetches++;
-					dbc->rno += (long long unsigned) hf->nrows;
-					dbc->fno += (long long unsigned) hf->nrows;
-					show_progress (dbc->fetches);
-				}
-				closecursor (hf);
-			}
+		/* Keep the state for a restart, then wait for the next poll. */
+		if (state_file != NULL && ! test && nsqlfailed == 0)
+		{
+			write_watermark ();
 		}
-		fetch (hd);
-		dbc->fetches++;
-		dbc->rno += (long long unsigned) hd->nrows;
-		dbc->dno += (long long unsigned) hd->nrows;
-		show_progress (dbc->fetches);
+		if (debug > 5)
+		{
+			msg ("Poll %d done, %llu files so far, next in %d seconds",
+				poll + 1, dbc->fno, watch_seconds);
+		}
+		(void) fflush (NULL);
+		(void) sleep ((unsigned) watch_seconds);
+
+		/* Late commits are caught by going back the slack, the changes
+		   processed already are left out. */
+		watermark = poll_start - WATERMARK_SLACK;
+		watch_id = poll_id;
+		forget_changes ();
+
+		/* The changes of a poll are few, one join finds them with the
+		   indexes instead of a cursor for every collection. The polls
+		   run in this process, which knows the changes processed. */
+		keyset = false;
+		copyscan = false;
+		nparts = 0;
+		split_size = 0;
+		joinscan = ! dirsonly;
 	}
-	closecursor (hd);
 	free (pathname);
 	free (tpathname);
 	free (tdirname);
-
-	/* Last flush when needed. */
-	if (ntasks > 0)
+	close_write_connection ();
+	if (work != NULL)
 	{
-
-		/* Flush queue if it was parallel. */
-		flush_queue (work);
+		finish_work (work);
+		count_work (work);
 	}
-
-	/* Finish. */
-	res = pcmd (conn, "END");
-	PQclear (res);
 	PQfinish (conn);
+	if (plan_fd >= 0)
+	{
+		(void) close (plan_fd);
+	}
+	dbc->endclock = clock_seconds ();
 	dbc->endtime = time (NULL);
 	if (dbc->endtime == (time_t) -1)
 	{
@@ -2481,13 +8728,27 @@ main (int argc, char *argv[])
 	{
 		regfree (rxc);
 	}
+
+	/* The changes were all seen, unless only tested or SQL failed. */
+	if (state_file != NULL && ! test && nsqlfailed == 0)
+	{
+		write_watermark ();
+	}
 	if (summary)
 	{
 
 		/* Print summary. */
 		print_summary (dbc);
+		if (ntasks > 0)
+		{
+			print_work ();
+		}
 	}
-	exit (SUCCESS);
+	else if (print_stats)
+	{
+		print_statistics ();
+	}
+	exit (nsqlfailed > 0 ? FAILURE : SUCCESS);
 } 
 
 /* End of file IFIND.C */